@@ -26,11 +26,12 @@ function arcade()
   big = D(big, cut)
   local cxy = cylinderxy(0.0, 0.0, 2.0, mat_simple_index);
   local arcade = translation(16.0, 4.0, 10.0, D(big, cxy));
+  local holes = {}
   for i=0,6 do
     local hole = box(3.0,1.0,1.0, mat_simple_index)
-    arcade = D(arcade, translation(16.0,3.5,7.0+3.0*i,hole));
+    holes[#holes+1] = translation(16.0,3.5,7.0+3.0*i,hole)
   end
-  return arcade
+  return differencen(arcade, holes)
 end
 setfenv(arcade, csg)
 
@@ -41,10 +42,11 @@ function complexscene()
   local b0 = rotation(0.0, 25.0, 0.0, box(4.0,4.0,4.0,mat_simple_index))
   local d0 = translation(7.0, 5.0, 7.0, s);
   local d1 = translation(7.0, 5.0, 7.0, b0);
-  local c = D(d1, d0);
+  local cylinders = {D(d1, d0)}
   for i=0,15 do
-    c = U(c, capped_cylinder(2.0, 2.0+2.0*i, 1.0, 1.0, 2*i+2.0, mat_snoise_index))
+    cylinders[#cylinders+1] = capped_cylinder(2.0, 2.0+2.0*i, 1.0, 1.0, 2*i+2.0, mat_snoise_index)
   end
+  local c = unionn(cylinders)
   local b = box(3.5, 4.0, 3.5, mat_simple_index);
   local scene0 = D(c, translation(2.0,5.0,18.0, b));
 
@@ -6,6 +6,9 @@
 #include "intrusive_list.hpp"
 #if defined(__UNIX__)
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #endif
 #if !defined(__APPLE__)
 #include <malloc.h>
@@ -195,6 +198,34 @@ char *loadfile(const char *fn, int *size) {
   return buf;
 }
 
+#if defined(__UNIX__)
+void *mapfile(const char *fn, size_t &size) {
+  const auto fd = open(fn, O_RDONLY);
+  if (fd == -1) return NULL;
+  struct stat st;
+  if (fstat(fd, &st) == -1 || st.st_size == 0) {
+    close(fd);
+    return NULL;
+  }
+  // private mapping: pages are only copied if someone writes into them
+  const auto ptr = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (ptr == MAP_FAILED) return NULL;
+  size = st.st_size;
+  return ptr;
+}
+void unmapfile(void *ptr, size_t size) { munmap(ptr, size); }
+#else
+void *mapfile(const char *fn, size_t &size) {
+  int len;
+  const auto buf = loadfile(fn, &len);
+  if (buf == NULL) return NULL;
+  size = len;
+  return buf;
+}
+void unmapfile(void *ptr, size_t) { FREE(ptr); }
+#endif
+
 void quit(const char *msg) {
 #if defined(RELEASE)
 #if defined(__WIN32__)
@@ -234,12 +265,24 @@ float millis() {
   static double first = double(val.QuadPart) / double(freq.QuadPart) * 1e3;
   return float(double(val.QuadPart) / double(freq.QuadPart) * 1e3 - first);
 }
+
+u64 microseconds() {
+  LARGE_INTEGER freq, val;
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&val);
+  return u64(double(val.QuadPart) / double(freq.QuadPart) * 1e6);
+}
 #else
 float millis() {
   struct timeval tp; gettimeofday(&tp,NULL);
   static double first = double(tp.tv_sec)*1e3 + double(tp.tv_usec)*1e-3;
   return float(double(tp.tv_sec)*1e3 + double(tp.tv_usec)*1e-3 - first);
 }
+
+u64 microseconds() {
+  struct timeval tp; gettimeofday(&tp,NULL);
+  return u64(tp.tv_sec)*1000000 + u64(tp.tv_usec);
+}
 #endif
 
 void writebmp(const int *data, int w, int h, const char *filename) {
@@ -637,8 +637,11 @@ void fatal(const char *s, const char *o = "");
 void quit(const char *msg = NULL);
 void keyrepeat(bool on);
 float millis();
+u64 microseconds(); // full precision time for short measurements
 char *path(char *s);
 char *loadfile(const char *fn, int *size=NULL);
+void *mapfile(const char *fn, size_t &size); // copy-on-write mapping
+void unmapfile(void *ptr, size_t size);
 void initendiancheck();
 int islittleendian();
 void endianswap(void *memory, int stride, int length);
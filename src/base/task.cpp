@@ -67,7 +67,9 @@ INLINE internal::internal(const char *name, u32 n, u32 waiternum, u32 queue, u16
   owner(tasking::queues[queue]), name(name), elemnum(n), tostart(1), toend(n),
   depnum(0), waiternum(waiternum), tasktostartnum(0), tasktoendnum(0),
   policy(policy), state(tasking::UNSCHEDULED)
-{}
+{
+  loopi(MAXDEP) deps[i] = NULL;
+}
 INLINE task *internal::parent(void) {
   return (task*)((char*)this-OFFSETOF(task,opaque));
 }
@@ -78,10 +80,11 @@ void internal::wait(bool recursivewait) {
          (recursivewait||waiternum > 0));
   auto job = parent();
 
-  // execute all starting dependencies
+  // execute all starting dependencies. a dependency may be added while we run
+  // and be not published yet
   while (tostart)
     loopi(depnum)
-      if (tasking::inner(deps[i]).toend)
+      if (deps[i] && tasking::inner(deps[i]).toend)
         inner(deps[i]).wait(true);
 
   // execute the run function
@@ -105,7 +108,7 @@ void internal::wait(bool recursivewait) {
 #endif
   while (toend) {
     loopi(depnum)
-      if (tasking::inner(deps[i]).toend)
+      if (deps[i] && tasking::inner(deps[i]).toend)
         inner(deps[i]).wait(true);
 #if defined(__SSE__)
     else
@@ -114,9 +117,7 @@ void internal::wait(bool recursivewait) {
 #endif
   }
 
-  // finished and no more waiters, we can safely release the dependency array
-  if (!recursivewait && --waiternum == 0)
-    loopi(depnum) deps[i]->release();
+  if (!recursivewait) --waiternum;
 }
 
 void queue::append(task *job) {
@@ -147,10 +148,6 @@ void queue::terminate(task *job) {
       terminate(self.taskstoend[i]);
     self.taskstoend[i]->release();
   }
-
-  // if no more waiters, we can safely free all dependencies since we are done
-  if (self.waiternum == 0)
-    loopi(self.depnum) self.deps[i]->release();
   job->release();
 }
 
@@ -239,7 +236,14 @@ task::task(const char *name, u32 n, u32 waiternum, u32 queue, u16 policy) {
   assert(n > 0 && "cannot create a task with no work to do");
   new (opaque) tasking::internal(name,n,waiternum,queue,policy);
 }
-task::~task(void) { tasking::inner(this).~internal(); }
+// dependencies are only released with the task. a waiter may still go over
+// the dependency array (and recursively over the dependencies of them) while
+// the task terminates
+task::~task(void) {
+  auto &self = tasking::inner(this);
+  loopi(self.depnum) self.deps[i]->release();
+  self.~internal();
+}
 
 void task::run(u32 elt) {}
 
@@ -111,7 +111,7 @@ template <class T> struct vector : noncopyable {
   static INLINE int heapparent(int i) { return (i - 1) >> 1; }
   static INLINE int heapchild(int i) { return (i << 1) + 1; }
 
-  void buildheap() { for(int i = ulen/2; i >= 0; i--) downheap(i); }
+  void buildheap() { for(int i = ulen/2-1; i >= 0; i--) downheap(i); }
 
   int upheap(int i) {
     auto score = buf[i];
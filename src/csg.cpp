@@ -4,6 +4,12 @@
  -------------------------------------------------------------------------*/
 #include "csg.hpp"
 #include "csginternal.hpp"
+#include "csgscalar.hpp"
+#include "csgsse.hpp"
+#include "csgavx.hpp"
+#include "base/algorithm.hpp"
+#include "base/hash.hpp"
+#include "base/console.hpp"
 #include "base/math.hpp"
 #include "base/script.hpp"
 #include "base/sys.hpp"
@@ -21,7 +27,561 @@ void destroyscene(node *n) {
   root = NULL;
 }
 
+/*--------------------------------------------------------------------------
+ - n-ary operators. the bvh is built top-down by splitting the children in
+ - two halves along the largest extent of their box centers
+ -------------------------------------------------------------------------*/
+static INLINE vec3f center(const aabb &box) {
+  return 0.5f*box.pmin + 0.5f*box.pmax;
+}
+
+static u32 buildbvh(nary &n, u32 *ids, u32 num) {
+  const u32 idx = n.bvh.length();
+  n.bvh.add();
+  auto box = aabb::empty(), centers = aabb::empty();
+  loopi(num) {
+    const auto &b = n.children[ids[i]]->box;
+    const auto c = center(b);
+    box = sum(box, b);
+    centers = sum(centers, aabb(c, c));
+  }
+  n.bvh[idx].box = box;
+  if (num == 1) {
+    n.bvh[idx].right = 0;
+    n.bvh[idx].child = ids[0];
+    return idx;
+  }
+  const auto extent = centers.pmax - centers.pmin;
+  const auto axis = extent.x > extent.y ?
+    (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+  const auto &children = n.children;
+  quicksort(ids, num, [&](u32 a, u32 b) {
+    return center(children[a]->box)[axis] < center(children[b]->box)[axis];
+  });
+  const auto half = num/2;
+  buildbvh(n, ids, half);
+  const auto right = buildbvh(n, ids+half, num-half);
+  n.bvh[idx].right = right;
+  n.bvh[idx].child = bvhnode::INNER;
+  return idx;
+}
+
+nary::nary(CSGOP type, const ref<node> *nodes, u32 num) : node(type) {
+  loopi(num) if (nodes[i].ptr != NULL && nodes[i]->type != C_EMPTY)
+    children.add(nodes[i]);
+  if (children.length() == 0) return;
+  vector<u32> ids(children.length());
+  loopv(ids) ids[i] = i;
+  buildbvh(*this, ids.begin(), ids.length());
+  box = bvh[0].box;
+}
+
+static void getchildren(const luabridge::LuaRef &t, vector<ref<node>> &children) {
+  const auto num = t.length();
+  loopi(num) children.add(t[i+1].cast<ref<node>>());
+}
+
+static ref<node> makeunionn(luabridge::LuaRef t) {
+  vector<ref<node>> children;
+  getchildren(t, children);
+  return NEW(unionn, children.begin(), children.length());
+}
+
+static ref<node> makedifferencen(const ref<node> &left, luabridge::LuaRef t) {
+  vector<ref<node>> children;
+  getchildren(t, children);
+  return NEW(differencen, left, children.begin(), children.length());
+}
+
+/*--------------------------------------------------------------------------
+ - specialize a tree for a region. nodes that are culled by the region box
+ - are removed, binary nodes with only one child left collapse into it when
+ - their box contains the child box and nested translations are merged
+ -------------------------------------------------------------------------*/
+static INLINE bool contains(const aabb &outer, const aabb &inner) {
+  return all(le(outer.pmin, inner.pmin)) && all(ge(outer.pmax, inner.pmax));
+}
+
+static ref<node> makebinary(const binary *b, const ref<node> &left,
+                            const ref<node> &right)
+{
+  ref<node> n;
+  switch (b->type) {
+    case C_UNION: n = NEW(U, left, right); break;
+    case C_DIFFERENCE: n = NEW(D, left, right); break;
+    case C_INTERSECTION: n = NEW(I, left, right); break;
+    case C_REPLACE: n = NEW(R, left, right); break;
+    default: assert("unreachable" && false);
+  }
+  n->box = b->box;
+  return n;
+}
+
+static ref<node> specializer(node *n, const aabb &box);
+
+// gather the children of a n-ary node that overlap the box
+static bool specializebvh(const nary *n, u32 idx, const aabb &box,
+                          vector<ref<node>> &kept)
+{
+  const auto &b = n->bvh[idx];
+  if (culled(b.box, box)) return true;
+  if (b.child == bvhnode::INNER) {
+    const auto l = specializebvh(n, idx+1, box, kept);
+    const auto r = specializebvh(n, b.right, box, kept);
+    return l || r;
+  }
+  const auto &child = n->children[b.child];
+  const auto c = specializer(child, box);
+  if (c) kept.add(c);
+  return c.ptr != child.ptr;
+}
+
+// children of binary nodes are tested against the box by their parent
+static ref<node> specializechild(node *n, const aabb &box) {
+  if (culled(n->box, box)) return ref<node>();
+  return specializer(n, box);
+}
+
+// NULL is returned when the node does not output anything in the box
+static ref<node> specializer(node *n, const aabb &box) {
+  switch (n->type) {
+    case C_UNION:
+    case C_DIFFERENCE:
+    case C_INTERSECTION:
+    case C_REPLACE: {
+      const auto b = static_cast<binary*>(n);
+      const auto left = specializechild(b->left, box);
+      const auto right = specializechild(b->right, box);
+      if (!left && !right) return ref<node>();
+      if (!left && n->type != C_UNION) return ref<node>();
+      if (!right && n->type == C_INTERSECTION) return ref<node>();
+      if (!left || !right) {
+        const auto &child = left ? left : right;
+        if (contains(n->box, child->box)) return child;
+      }
+      if (left.ptr == b->left.ptr && right.ptr == b->right.ptr) return n;
+      return makebinary(b, left, right);
+    }
+    case C_UNIONN:
+    case C_DIFFERENCEN: {
+      const auto nn = static_cast<nary*>(n);
+      ref<node> left;
+      auto changed = false;
+      if (n->type == C_DIFFERENCEN) {
+        const auto d = static_cast<differencen*>(n);
+        left = specializechild(d->left, box);
+        if (!left) return ref<node>();
+        changed = left.ptr != d->left.ptr;
+      }
+      vector<ref<node>> kept;
+      if (nn->bvh.length() != 0)
+        changed = specializebvh(nn, 0, box, kept) || changed;
+      if (!changed) return n;
+      ref<node> newn;
+      if (n->type == C_UNIONN) {
+        if (kept.length() == 0) return ref<node>();
+        if (kept.length() == 1 && contains(n->box, kept[0]->box)) return kept[0];
+        newn = NEW(unionn, kept.begin(), kept.length());
+      } else {
+        if (kept.length() == 0 && contains(n->box, left->box)) return left;
+        newn = NEW(differencen, left, kept.begin(), kept.length());
+      }
+      newn->box = n->box;
+      return newn;
+    }
+    case C_TRANSLATION: {
+      const auto t = static_cast<translation*>(n);
+      const aabb tbox(box.pmin-t->p, box.pmax-t->p);
+      const auto child = specializechild(t->n, tbox);
+      if (!child) return ref<node>();
+      if (child->type == C_TRANSLATION) {
+        const auto sub = static_cast<const translation*>(child.ptr);
+        const auto subbox = fixedaabb(sub->n);
+        if (contains(sub->box, aabb(sub->p+subbox.pmin, sub->p+subbox.pmax))) {
+          ref<node> merged = NEW(translation, t->p+sub->p, sub->n);
+          merged->box = t->box;
+          return merged;
+        }
+      }
+      if (child.ptr == t->n.ptr) return n;
+      ref<node> newt = NEW(translation, t->p, child);
+      newt->box = t->box;
+      return newt;
+    }
+    case C_ROTATION: {
+      const auto r = static_cast<rotation*>(n);
+      const auto child = specializechild(r->n, xfmbox(conj(r->q), box));
+      if (!child) return ref<node>();
+      if (child.ptr == r->n.ptr) return n;
+      ref<node> newr = NEW(rotation, r->q, child);
+      newr->box = r->box;
+      return newr;
+    }
+    case C_EMPTY: return ref<node>();
+    default: return n;
+  }
+}
+
+ref<node> specialize(const node *n, const aabb &box) {
+  const auto nn = const_cast<node*>(n);
+  switch (n->type) {
+    case C_UNION:
+    case C_DIFFERENCE:
+    case C_INTERSECTION:
+    case C_REPLACE:
+    case C_UNIONN:
+    case C_DIFFERENCEN:
+      return specializer(nn, box);
+    default:
+      return specializechild(nn, box);
+  }
+}
+
+/*--------------------------------------------------------------------------
+ - structural hash. boxes and bvhs are derived from the other fields so they
+ - are skipped
+ -------------------------------------------------------------------------*/
+template <typename T> static INLINE u32 hashfield(const T &x, u32 h) {
+  return murmurhash2(&x, sizeof(T), h);
+}
+
+static u32 hashnode(const node *n, u32 h);
+static u32 hashchildren(const nary *n, u32 h) {
+  h = hashfield(u32(n->children.length()), h);
+  loopv(n->children) h = hashnode(n->children[i], h);
+  return h;
+}
+
+static u32 hashnode(const node *n, u32 h) {
+  h = hashfield(u32(n->type), h);
+  switch (n->type) {
+    case C_UNION:
+    case C_DIFFERENCE:
+    case C_INTERSECTION:
+    case C_REPLACE: {
+      const auto b = static_cast<const binary*>(n);
+      return hashnode(b->right, hashnode(b->left, h));
+    }
+    case C_DIFFERENCEN: {
+      const auto d = static_cast<const differencen*>(n);
+      return hashchildren(d, hashnode(d->left, h));
+    }
+    case C_UNIONN:
+      return hashchildren(static_cast<const nary*>(n), h);
+    case C_TRANSLATION: {
+      const auto t = static_cast<const translation*>(n);
+      return hashnode(t->n, hashfield(t->p, h));
+    }
+    case C_ROTATION: {
+      const auto r = static_cast<const rotation*>(n);
+      return hashnode(r->n, hashfield(r->q, h));
+    }
+    case C_PLANE: {
+      const auto p = static_cast<const plane*>(n);
+      return hashfield(p->p, hashfield(p->matindex, h));
+    }
+#define CYL(NAME, COORD)\
+    case C_CYLINDER##NAME: {\
+      const auto c = static_cast<const cylinder##COORD*>(n);\
+      h = hashfield(c->matindex, h);\
+      return hashfield(c->r, hashfield(c->c##COORD, h));\
+    }
+    CYL(XY,xy) CYL(XZ,xz) CYL(YZ,yz)
+#undef CYL
+    case C_SPHERE: {
+      const auto s = static_cast<const sphere*>(n);
+      return hashfield(s->r, hashfield(s->matindex, h));
+    }
+    case C_BOX: {
+      const auto b = static_cast<const struct box*>(n);
+      return hashfield(b->extent, hashfield(b->matindex, h));
+    }
+    case C_EMPTY: return h;
+    case C_INVALID: assert("unreachable" && false);
+  }
+  return h;
+}
+
+// two chains with different seeds make a 64 bits hash
+u64 hashnode(const node *n) {
+  if (n == NULL) return 0;
+  return u64(hashnode(n, 0xffffffffu)) << 32 | u64(hashnode(n, 0x9e3779b9u));
+}
+
+/*--------------------------------------------------------------------------
+ - flatten the tree into a program. register 0 and frame 0 are the output
+ - and input arrays given to the interpreters. right children of binary
+ - nodes get the first free register while left children directly write into
+ - the register of their parent
+ -------------------------------------------------------------------------*/
+static instruction &emit(program &p, u32 op, u32 frame, u32 dreg, u32 mreg) {
+  auto &ins = p.code.add();
+  ins.box = ins.rbox = aabb::empty();
+  ins.p = vec4f(zero);
+  ins.q = quat3f(one);
+  ins.matindex = MAT_AIR_INDEX;
+  ins.mid = ins.end = 0;
+  ins.op = op;
+  ins.frame = frame;
+  ins.dreg = dreg;
+  ins.mreg = mreg;
+  ins.treg = 0;
+  ins.cull = 1;
+  ins.rotated = 0;
+  return ins;
+}
+
+// primitives output their gradients in world space
+static void setframe(instruction &ins, const quat3f &rot) {
+  ins.q = rot;
+  ins.rotated = rot.r != 1.f || rot.i != 0.f || rot.j != 0.f || rot.k != 0.f;
+}
+
+// patch the three instructions of a binary operator once its code is known
+static void link(program &p, u32 begin, u32 mid, u32 end,
+                 const aabb &lbox, const aabb &rbox, u32 treg)
+{
+  const u32 idx[] = {begin, mid, end};
+  loopi(3) {
+    auto &ins = p.code[idx[i]];
+    ins.box = lbox;
+    ins.rbox = rbox;
+    ins.treg = treg;
+    ins.mid = mid;
+    ins.end = end+1;
+  }
+}
+
+static void compile(program &p, const node *n, u32 frame, u32 dreg, u32 mreg,
+                    u32 freereg, bool cull, const quat3f &rot);
+
+// n-ary operators become a tree of binary unions following their bvh
+static void compilebvh(program &p, const nary *n, u32 idx, u32 frame,
+                       u32 dreg, u32 mreg, u32 freereg, bool cull,
+                       const quat3f &rot)
+{
+  const auto &b = n->bvh[idx];
+  if (b.child != bvhnode::INNER) {
+    compile(p, n->children[b.child], frame, dreg, mreg, freereg, cull, rot);
+    return;
+  }
+  const auto begin = p.code.length();
+  emit(p, OP_UNION, frame, dreg, mreg);
+  compilebvh(p, n, idx+1, frame, dreg, mreg, freereg, false, rot);
+  const auto mid = p.code.length();
+  emit(p, OP_UNION_MID, frame, dreg, mreg);
+  compilebvh(p, n, b.right, frame, freereg, freereg, freereg+1, false, rot);
+  const auto end = p.code.length();
+  emit(p, OP_UNION_END, frame, dreg, mreg);
+  link(p, begin, mid, end, n->bvh[idx+1].box, n->bvh[b.right].box, freereg);
+}
+
+static void compile(program &p, const node *n, u32 frame, u32 dreg, u32 mreg,
+                    u32 freereg, bool cull, const quat3f &rot)
+{
+  p.regnum = max(p.regnum, max(dreg, mreg)+1);
+  p.framenum = max(p.framenum, frame+1);
+  switch (n->type) {
+#define BINARY(TYPE, OP, RIGHTMREG)\
+    case TYPE: {\
+      const auto b = static_cast<const binary*>(n);\
+      const auto begin = p.code.length();\
+      emit(p, OP, frame, dreg, mreg);\
+      compile(p, b->left, frame, dreg, mreg, freereg, false, rot);\
+      const auto mid = p.code.length();\
+      emit(p, OP##_MID, frame, dreg, mreg);\
+      compile(p, b->right, frame, freereg, RIGHTMREG, freereg+1, false, rot);\
+      const auto end = p.code.length();\
+      emit(p, OP##_END, frame, dreg, mreg);\
+      link(p, begin, mid, end, b->left->box, b->right->box, freereg);\
+    }\
+    break;
+    BINARY(C_UNION, OP_UNION, freereg)
+    BINARY(C_DIFFERENCE, OP_DIFFERENCE, freereg)
+    BINARY(C_INTERSECTION, OP_INTERSECTION, mreg)
+    BINARY(C_REPLACE, OP_REPLACE, freereg)
+#undef BINARY
+    case C_UNIONN: {
+      const auto u = static_cast<const unionn*>(n);
+      if (u->bvh.length() != 0)
+        compilebvh(p, u, 0, frame, dreg, mreg, freereg, cull, rot);
+    }
+    break;
+    case C_DIFFERENCEN: {
+      const auto d = static_cast<const differencen*>(n);
+      if (d->bvh.length() == 0) {
+        compile(p, d->left, frame, dreg, mreg, freereg, cull, rot);
+        break;
+      }
+      const auto begin = p.code.length();
+      emit(p, OP_DIFFERENCE, frame, dreg, mreg);
+      compile(p, d->left, frame, dreg, mreg, freereg, false, rot);
+      const auto mid = p.code.length();
+      emit(p, OP_DIFFERENCE_MID, frame, dreg, mreg);
+      compilebvh(p, d, 0, frame, freereg, freereg, freereg+1, false, rot);
+      const auto end = p.code.length();
+      emit(p, OP_DIFFERENCE_END, frame, dreg, mreg);
+      link(p, begin, mid, end, d->left->box, d->bvh[0].box, freereg);
+    }
+    break;
+    case C_TRANSLATION: {
+      const auto t = static_cast<const translation*>(n);
+      const auto idx = p.code.length();
+      auto &ins = emit(p, OP_TRANSLATION, frame, dreg, mreg);
+      ins.box = t->box;
+      ins.p = vec4f(t->p, 0.f);
+      ins.cull = cull;
+      compile(p, t->n, frame+1, dreg, mreg, freereg, true, rot);
+      p.code[idx].end = p.code.length();
+    }
+    break;
+    case C_ROTATION: {
+      const auto r = static_cast<const rotation*>(n);
+      const auto idx = p.code.length();
+      auto &ins = emit(p, OP_ROTATION, frame, dreg, mreg);
+      ins.box = r->box;
+      ins.q = r->q;
+      ins.cull = cull;
+      compile(p, r->n, frame+1, dreg, mreg, freereg, true, rot*r->q);
+      p.code[idx].end = p.code.length();
+    }
+    break;
+    case C_PLANE: {
+      const auto pl = static_cast<const plane*>(n);
+      auto &ins = emit(p, OP_PLANE, frame, dreg, mreg);
+      ins.p = pl->p;
+      ins.matindex = pl->matindex;
+      ins.box = n->box;
+      ins.cull = cull;
+      setframe(ins, rot);
+    }
+    break;
+#define CYL(NAME, COORD)\
+    case C_CYLINDER##NAME: {\
+      const auto c = static_cast<const cylinder##COORD*>(n);\
+      auto &ins = emit(p, OP_CYLINDER##NAME, frame, dreg, mreg);\
+      ins.p = vec4f(c->c##COORD.x, c->c##COORD.y, c->r, 0.f);\
+      ins.matindex = c->matindex;\
+      ins.box = n->box;\
+      ins.cull = cull;\
+      setframe(ins, rot);\
+    }\
+    break;
+    CYL(XY,xy) CYL(XZ,xz) CYL(YZ,yz)
+#undef CYL
+    case C_SPHERE: {
+      const auto s = static_cast<const sphere*>(n);
+      auto &ins = emit(p, OP_SPHERE, frame, dreg, mreg);
+      ins.p = vec4f(s->r, 0.f, 0.f, 0.f);
+      ins.matindex = s->matindex;
+      ins.box = n->box;
+      ins.cull = cull;
+      setframe(ins, rot);
+    }
+    break;
+    case C_BOX: {
+      const auto b = static_cast<const struct box*>(n);
+      auto &ins = emit(p, OP_BOX, frame, dreg, mreg);
+      ins.p = vec4f(b->extent, 0.f);
+      ins.matindex = b->matindex;
+      ins.box = n->box;
+      ins.cull = cull;
+      setframe(ins, rot);
+    }
+    break;
+    case C_EMPTY: break;
+    case C_INVALID: assert("unreachable" && false);
+  }
+}
+
+program *compile(const node *n) {
+  auto p = NEWE(program);
+  if (n != NULL) compile(*p, n, 0, 0, 0, 1, true, quat3f(one));
+  return p;
+}
+
+void destroyprogram(program *p) { SAFE_DEL(p); }
+u32 programlength(const program *p) { return p->code.length(); }
+
+registers::~registers() {
+  if (d) ALIGNEDFREE(d);
+  if (m) ALIGNEDFREE(m);
+  if (g) ALIGNEDFREE(g);
+  if (pos) ALIGNEDFREE(pos);
+  if (box) ALIGNEDFREE(box);
+}
+
+void registers::reserve(const program *p) {
+  if (p->regnum > regnum) {
+    if (d) ALIGNEDFREE(d);
+    if (m) ALIGNEDFREE(m);
+    if (g) ALIGNEDFREE(g);
+    regnum = p->regnum;
+    d = (arrayf*) ALIGNEDMALLOC(regnum*sizeof(arrayf), CACHE_LINE_ALIGNMENT);
+    m = (arrayi*) ALIGNEDMALLOC(regnum*sizeof(arrayi), CACHE_LINE_ALIGNMENT);
+    g = (array3f*) ALIGNEDMALLOC(regnum*sizeof(array3f), CACHE_LINE_ALIGNMENT);
+  }
+  if (p->framenum > framenum) {
+    if (pos) ALIGNEDFREE(pos);
+    if (box) ALIGNEDFREE(box);
+    framenum = p->framenum;
+    pos = (array3f*) ALIGNEDMALLOC(framenum*sizeof(array3f), CACHE_LINE_ALIGNMENT);
+
+    // one more box since simd paths load four floats from pmax
+    box = (aabb*) ALIGNEDMALLOC((framenum+1)*sizeof(aabb), CACHE_LINE_ALIGNMENT);
+  }
+}
+
+/*--------------------------------------------------------------------------
+ - evaluation routines are picked at start up from the cpu features. csgisa
+ - overrides the choice (0: best available, 1: scalar, 2: sse, 3: avx)
+ -------------------------------------------------------------------------*/
+typedef void (*distfunc)(const program *RESTRICT, registers &RESTRICT,
+                         const array3f &RESTRICT, const arrayf *RESTRICT,
+                         arrayf &RESTRICT, arrayi &RESTRICT,
+                         array3f *RESTRICT, int, const aabb &RESTRICT);
+struct isaentry {
+  const char *name;
+  distfunc dist;
+  bool (*supported)();
+};
+static bool hasscalar() { return true; }
+static bool hassse() {
+  return sys::hasfeature(sys::CPU_SSE) && sys::hasfeature(sys::CPU_SSE2);
+}
+static bool hasavx() {
+  return sys::hasfeature(sys::CPU_AVX) && sys::hasfeature(sys::CPU_YMM);
+}
+static const isaentry isatable[] = {
+  {"scalar", scalar::dist, hasscalar},
+  {"sse", sse::dist, hassse},
+  {"avx", avx::dist, hasavx}
+};
+static const u32 ISA_NUM = ARRAY_ELEM_NUM(isatable);
+static const isaentry *isa = isatable;
+
+static void selectisa();
+VARF(csgisa, 0, 0, ISA_NUM, selectisa());
+static void selectisa() {
+  auto idx = csgisa == 0 ? int(ISA_NUM)-1 : csgisa-1;
+  while (!isatable[idx].supported()) --idx;
+  if (csgisa != 0 && idx != csgisa-1)
+    con::out("csg: %s is not supported by this cpu", isatable[csgisa-1].name);
+  isa = isatable+idx;
+  con::out("csg: using %s evaluation routines", isa->name);
+}
+
+void dist(const program *RESTRICT prog, registers &RESTRICT regs,
+          const array3f &RESTRICT pos, const arrayf *RESTRICT normaldist,
+          arrayf &RESTRICT d, arrayi &RESTRICT mat, array3f *RESTRICT grad,
+          int num, const aabb &RESTRICT box)
+{
+  isa->dist(prog, regs, pos, normaldist, d, mat, grad, num, box);
+}
+
 void start() {
+  selectisa();
+
 #define ENUM(NAMESPACE,NAME,VALUE)\
   static const u32 NAME = VALUE;\
   luabridge::getGlobalNamespace(script::luastate())\
@@ -40,6 +600,8 @@ void start() {
   luabridge::getGlobalNamespace(script::luastate())
   .beginNamespace("csg")
     .addFunction("setroot", setroot)
+    .addFunction("unionn", makeunionn)
+    .addFunction("differencen", makedifferencen)
     .beginClass<node>("node")
       .addFunction("setmin", &node::setmin)
       .addFunction("setmax", &node::setmax)
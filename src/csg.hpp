@@ -5,6 +5,7 @@
 #pragma once
 #include "base/ref.hpp"
 #include "base/math.hpp"
+#include "base/utility.hpp"
 #include "soa.hpp"
 
 namespace q {
@@ -39,7 +40,7 @@ material *getmaterial(u32 matindex);
 enum CSGOP {
   C_EMPTY, C_UNION, C_DIFFERENCE, C_INTERSECTION, C_REPLACE,
   C_SPHERE, C_BOX, C_PLANE, C_CYLINDERXZ, C_CYLINDERYZ, C_CYLINDERXY,
-  C_TRANSLATION, C_ROTATION,
+  C_TRANSLATION, C_ROTATION, C_UNIONN, C_DIFFERENCEN,
   C_INVALID = 0xffffffff
 };
 struct node : refcount {
@@ -56,6 +57,12 @@ struct node : refcount {
 node *makescene();
 void destroyscene(node *n);
 
+// simplify the tree for points (and query boxes) inside the given box
+ref<node> specialize(const node *n, const aabb &box);
+
+// structural hash of the tree. equal trees give the same hash across runs
+u64 hashnode(const node *n);
+
 /*--------------------------------------------------------------------------
  - for soa computations
  -------------------------------------------------------------------------*/
@@ -65,6 +72,33 @@ typedef CACHE_LINE_ALIGNED q::arrayf<MAXPOINTNUM> arrayf;
 typedef CACHE_LINE_ALIGNED q::array2f<MAXPOINTNUM> array2f;
 typedef CACHE_LINE_ALIGNED q::array3f<MAXPOINTNUM> array3f;
 typedef CACHE_LINE_ALIGNED q::array4f<MAXPOINTNUM> array4f;
+
+/*--------------------------------------------------------------------------
+ - csg trees are compiled into flat programs before evaluation
+ -------------------------------------------------------------------------*/
+struct program;
+program *compile(const node *n);
+void destroyprogram(program *p);
+u32 programlength(const program *p); // number of instructions
+
+// scratch space used by the program interpreters. one per evaluating thread
+struct registers : noncopyable {
+  INLINE registers() :
+    d(NULL), m(NULL), g(NULL), pos(NULL), box(NULL), regnum(0), framenum(0) {}
+  ~registers();
+  void reserve(const program *p);
+  arrayf *d;
+  arrayi *m;
+  array3f *g;
+  array3f *pos;
+  aabb *box;
+  u32 regnum, framenum;
+};
+
+/*--------------------------------------------------------------------------
+ - evaluation routines dispatched at run time to the best (or requested) ISA
+ -------------------------------------------------------------------------*/
+#include "csgdecl.hxx"
 } /* namespace csg */
 } /* namespace q */
 
@@ -2,8 +2,8 @@
  - mini.q - a minimalistic multiplayer fps
  - csgdecl.hxx -> template to declare various csg evaluation routines
  -------------------------------------------------------------------------*/
-// many points evaluation
-void dist(const node *RESTRICT, const array3f &RESTRICT,
+// many points evaluation of a compiled csg program. gradients are computed
+// analytically in the same pass when grad is not null
+void dist(const program *RESTRICT, registers &RESTRICT, const array3f &RESTRICT,
           const arrayf *RESTRICT, arrayf &RESTRICT, arrayi &RESTRICT,
-          int num, const aabb &RESTRICT);
-
+          array3f *RESTRICT grad, int num, const aabb &RESTRICT);
@@ -4,6 +4,7 @@
  -------------------------------------------------------------------------*/
 #pragma once
 #include "csg.hpp"
+#include "base/vector.hpp"
 
 namespace q {
 namespace csg {
@@ -18,11 +19,17 @@ static INLINE ref<node> fixednode(const ref<node> &n) {
   return NULL!=n.ptr?n:NEWE(emptynode);
 }
 
+struct binary : node {
+  INLINE binary(CSGOP type, const aabb &box,
+                const ref<node> &nleft, const ref<node> &nright) :
+    node(type, box), left(fixednode(nleft)), right(fixednode(nright)) {}
+  ref<node> left, right;
+};
+
 #define BINARY(NAME,TYPE,C_BOX) \
-struct NAME : node { \
+struct NAME : binary { \
   INLINE NAME(const ref<node> &nleft, const ref<node> &nright) :\
-    node(TYPE, C_BOX), left(fixednode(nleft)), right(fixednode(nright)) {}\
-  ref<node> left, right; \
+    binary(TYPE, C_BOX, nleft, nright) {}\
 };
 BINARY(U, C_UNION, sum(fixedaabb(nleft), fixedaabb(nright)))
 BINARY(D, C_DIFFERENCE, fixedaabb(nleft))
@@ -30,6 +37,39 @@ BINARY(I, C_INTERSECTION, intersection(fixedaabb(nleft), fixedaabb(nright)))
 BINARY(R, C_REPLACE, fixedaabb(nleft));
 #undef BINARY
 
+/*--------------------------------------------------------------------------
+ - n-ary operators keep their children under a bvh. nodes are stored depth
+ - first so the left child of an inner node is the next one in the array.
+ - each leaf references exactly one child
+ -------------------------------------------------------------------------*/
+struct bvhnode {
+  enum {INNER = 0xffffffffu};
+  aabb box;
+  u32 right; // index of the right child for inner nodes
+  u32 child; // index in the children array for leaves, INNER otherwise
+};
+
+struct nary : node {
+  nary(CSGOP type, const ref<node> *children, u32 num);
+  vector<ref<node>> children;
+  vector<bvhnode> bvh;
+};
+
+// union of all children
+struct unionn : nary {
+  INLINE unionn(const ref<node> *children, u32 num) :
+    nary(C_UNIONN, children, num) {}
+};
+
+// left minus the union of all children
+struct differencen : nary {
+  INLINE differencen(const ref<node> &nleft, const ref<node> *children, u32 num) :
+    nary(C_DIFFERENCEN, children, num), left(fixednode(nleft)) {
+    box = left->box;
+  }
+  ref<node> left;
+};
+
 struct materialnode : node {
   INLINE materialnode(CSGOP type, const aabb &box = aabb::empty(), u32 matindex = MAT_SIMPLE_INDEX) :
     node(type, box), matindex(matindex) {}
@@ -102,15 +142,72 @@ struct translation : node {
   vec3f p;
   ref<node> n;
 };
+// conservative bounds of a box rotated by q. unbounded boxes stay unbounded
+INLINE aabb xfmbox(const quat3f &q, const aabb &box) {
+  if (any(gt(box.pmin, box.pmax))) return box;
+  if (any(le(box.pmin, vec3f(-FLT_MAX))) || any(ge(box.pmax, vec3f(FLT_MAX))))
+    return aabb::all();
+  const auto c = xfmpoint(q, 0.5f*box.pmin + 0.5f*box.pmax);
+  const auto e = 0.5f*box.pmax - 0.5f*box.pmin;
+  const auto ex = abs(xfmpoint(q, vec3f(1.f,0.f,0.f)));
+  const auto ey = abs(xfmpoint(q, vec3f(0.f,1.f,0.f)));
+  const auto ez = abs(xfmpoint(q, vec3f(0.f,0.f,1.f)));
+  const auto r = ex*e.x + ey*e.y + ez*e.z;
+  const auto pad = 1e-5f*(abs(c)+r); // rounding of the rotation
+  return aabb(c-r-pad, c+r+pad);
+}
+
 struct rotation : node {
   INLINE rotation(const quat3f &q, const ref<node> &n) :
-    node(C_ROTATION, aabb::all()), q(q),
+    node(C_ROTATION, xfmbox(q, fixedaabb(n))), q(q),
     n(fixednode(n)) {}
   INLINE rotation(float deg0, float deg1, float deg2, const ref<node> &n) :
     rotation(quat3f(deg2rad(deg0),deg2rad(deg1),deg2rad(deg2)),n) {}
   quat3f q;
   ref<node> n;
 };
+
+/*--------------------------------------------------------------------------
+ - a program is the flattened version of a csg tree. binary operators are
+ - split into three instructions (begin, middle, end) around the code of
+ - their two children. culling decisions only depend on the boxes so they are
+ - recomputed at each step and the interpreters do not need any stack
+ -------------------------------------------------------------------------*/
+enum CSGOPCODE : u16 {
+  OP_UNION, OP_UNION_MID, OP_UNION_END,
+  OP_DIFFERENCE, OP_DIFFERENCE_MID, OP_DIFFERENCE_END,
+  OP_INTERSECTION, OP_INTERSECTION_MID, OP_INTERSECTION_END,
+  OP_REPLACE, OP_REPLACE_MID, OP_REPLACE_END,
+  OP_SPHERE, OP_BOX, OP_PLANE, OP_CYLINDERXY, OP_CYLINDERXZ, OP_CYLINDERYZ,
+  OP_TRANSLATION, OP_ROTATION
+};
+
+struct instruction {
+  aabb box;       // node box or left child box for binary operators
+  aabb rbox;      // right child box for binary operators
+  vec4f p;        // primitive parameters or translation
+  quat3f q;       // rotation or frame to world rotation for primitives
+  u32 matindex;   // material for primitives
+  u32 mid, end;   // jump targets. end is the first instruction after the node
+  u16 op;         // CSGOPCODE
+  u16 frame;      // position and box frame read by the instruction
+  u16 dreg, mreg; // distance and material registers written by the node
+  u16 treg;       // temporary register holding the right child result
+  u16 cull;       // 0 when the parent already tested the node box
+  u16 rotated;    // 1 when primitive gradients must be rotated by q
+};
+
+struct program {
+  INLINE program() : regnum(1), framenum(1) {}
+  vector<instruction> code;
+  u32 regnum, framenum;
+};
+
+// node box test shared by the scalar paths
+INLINE bool culled(const aabb &b0, const aabb &b1) {
+  const auto isec = intersection(b0, b1);
+  return any(gt(isec.pmin, isec.pmax));
+}
 } /* namespace csg */
 } /* namespace q */
 
@@ -8,178 +8,255 @@
 
 namespace q {
 namespace csg {
-static void distr(const node *RESTRICT n, const array3f &RESTRICT pos,
-                  const arrayf *RESTRICT normaldist, arrayf &RESTRICT dist,
-                  arrayi &RESTRICT matindex, int num, const aabb &RESTRICT box)
+namespace scalar {
+// primitives directly output world space gradients
+static INLINE vec3f world(const instruction &ins, const vec3f &g) {
+  return ins.rotated ? xfmvector(ins.q, g) : g;
+}
+static INLINE float safercp(float x) { return x > 0.f ? 1.f/x : 0.f; }
+
+void dist(const program *RESTRICT prog, registers &RESTRICT regs,
+          const array3f &RESTRICT pos, const arrayf *RESTRICT normaldist,
+          arrayf &RESTRICT d, arrayi &RESTRICT mat, array3f *RESTRICT grad,
+          int num, const aabb &RESTRICT box)
 {
-  switch (n->type) {
-    case C_UNION: {
-      const auto u = static_cast<const U*>(n);
-      const auto isecleft = intersection(u->left->box, box);
-      const auto isecright = intersection(u->right->box, box);
-      const auto goleft = all(le(isecleft.pmin, isecleft.pmax));
-      const auto goright = all(le(isecright.pmin, isecright.pmax));
-      if (goleft && goright) {
-        distr(u->left, pos, normaldist, dist, matindex, num, box);
-        arrayf tempdist;
-        arrayi tempmatindex;
+  assert(regs.regnum >= prog->regnum && regs.framenum >= prog->framenum);
+  loopi(num) d[i] = FLT_MAX;
+  loopi(num) mat[i] = MAT_AIR_INDEX;
+  if (grad) loopi(num) set(*grad, vec3f(zero), i);
+  regs.box[0] = box;
+
+  const auto code = prog->code.begin();
+  const auto len = prog->code.length();
+  int pc = 0;
+  while (pc < len) {
+    const auto &ins = code[pc];
+    const auto &qbox = regs.box[ins.frame];
+    const auto &p = ins.frame ? regs.pos[ins.frame] : pos;
+    auto &dd = ins.dreg ? regs.d[ins.dreg] : d;
+    auto &mm = ins.mreg ? regs.m[ins.mreg] : mat;
+    const auto gg = grad ? (ins.dreg ? regs.g+ins.dreg : grad) : NULL;
+    const auto tg = grad ? regs.g+ins.treg : NULL;
+    switch (ins.op) {
+      case OP_UNION: {
+        const auto goleft = !culled(ins.box, qbox);
+        const auto goright = !culled(ins.rbox, qbox);
+        pc = goleft ? pc+1 : (goright ? ins.mid : ins.end);
+      }
+      continue;
+      case OP_UNION_MID: {
+        if (culled(ins.rbox, qbox)) {
+          pc = ins.end;
+          continue;
+        }
+        auto &td = regs.d[ins.treg];
+        auto &tm = regs.m[ins.treg];
+
+        // when the left child is culled, the right child just goes on with
+        // our own results
+        if (culled(ins.box, qbox)) loopi(num) {
+          td[i] = dd[i];
+          tm[i] = mm[i];
+          if (gg) set(*tg, get(*gg,i), i);
+        } else loopi(num) {
+          td[i] = FLT_MAX;
+          tm[i] = MAT_AIR_INDEX;
+          if (gg) set(*tg, vec3f(zero), i);
+        }
+      }
+      break;
+      case OP_UNION_END: {
+        const auto &td = regs.d[ins.treg];
+        const auto &tm = regs.m[ins.treg];
+        if (culled(ins.box, qbox)) loopi(num) {
+          dd[i] = td[i];
+          mm[i] = tm[i];
+          if (gg) set(*gg, get(*tg,i), i);
+        } else {
+          loopi(num) mm[i] = max(mm[i], tm[i]);
+          loopi(num) {
+            const auto near = normaldist && abs(td[i]) < (*normaldist)[i];
+            const auto took = near || td[i] < dd[i];
+            if (gg && took) set(*gg, get(*tg,i), i);
+            dd[i] = near ? td[i] : min(dd[i], td[i]);
+          }
+        }
+      }
+      break;
+      case OP_REPLACE:
+        pc = culled(ins.box, qbox) ? ins.end : pc+1;
+      continue;
+      case OP_REPLACE_MID: {
+        if (culled(ins.rbox, qbox)) {
+          pc = ins.end;
+          continue;
+        }
+        auto &td = regs.d[ins.treg];
+        auto &tm = regs.m[ins.treg];
+        loopi(num) {
+          td[i] = FLT_MAX;
+          tm[i] = MAT_AIR_INDEX;
+        }
+        if (gg) loopi(num) set(*tg, vec3f(zero), i);
+      }
+      break;
+      case OP_REPLACE_END: {
+        const auto &td = regs.d[ins.treg];
+        const auto &tm = regs.m[ins.treg];
         loopi(num) {
-          tempdist[i] = FLT_MAX;
-          tempmatindex[i] = MAT_AIR_INDEX;
+          const auto insideright = td[i] < 0.f && dd[i] < 0.f;
+          mm[i] = insideright ? tm[i] : mm[i];
         }
-        distr(u->right, pos, normaldist, tempdist, tempmatindex, num, box);
-        loopi(num) matindex[i] = max(matindex[i], tempmatindex[i]);
         if (normaldist)
-          loopi(num)
-            dist[i] = abs(tempdist[i]) < (*normaldist)[i] ?
-              tempdist[i] :
-              min(dist[i], tempdist[i]);
-        else
-          loopi(num) dist[i] = min(dist[i], tempdist[i]);
-      } else if (goleft)
-        distr(u->left, pos, normaldist, dist, matindex, num, box);
-      else if (goright)
-        distr(u->right, pos, normaldist, dist, matindex, num, box);
-    }
-    break;
-    case C_REPLACE: {
-      const auto r = static_cast<const R*>(n);
-      const auto isecleft = intersection(r->left->box, box);
-      const auto goleft = all(le(isecleft.pmin, isecleft.pmax));
-      if (!goleft) return;
-      distr(r->left, pos, normaldist, dist, matindex, num, box);
-      const auto isecright = intersection(r->right->box, box);
-      const auto goright = all(le(isecright.pmin, isecright.pmax));
-      if (!goright) return;
-      arrayf tempdist;
-      arrayi tempmatindex;
-      loopi(num) {
-        tempdist[i] = FLT_MAX;
-        tempmatindex[i] = MAT_AIR_INDEX;
+          loopi(num) {
+            const auto took = dd[i] < 0.f && abs(td[i]) < (*normaldist)[i];
+            if (gg && took) set(*gg, get(*tg,i), i);
+            dd[i] = took ? td[i] : dd[i];
+          }
       }
-      distr(r->right, pos, normaldist, tempdist, tempmatindex, num, box);
-      loopi(num) {
-        const auto insideright = tempdist[i] < 0.f && dist[i] < 0.f;
-        matindex[i] = insideright ? tempmatindex[i] : matindex[i];
+      break;
+      case OP_INTERSECTION:
+        pc = culled(ins.box, qbox) || culled(ins.rbox, qbox) ? ins.end : pc+1;
+      continue;
+      case OP_INTERSECTION_MID: {
+        auto &td = regs.d[ins.treg];
+        loopi(num) td[i] = FLT_MAX;
+        if (gg) loopi(num) set(*tg, vec3f(zero), i);
       }
-      if (normaldist)
-        loopi(num)
-          dist[i] = dist[i] < 0.f && abs(tempdist[i]) < (*normaldist)[i] ?
-            tempdist[i] : dist[i];
-    }
-    break;
-    case C_INTERSECTION: {
-      const auto in = static_cast<const I*>(n);
-      const auto isecleft = intersection(in->left->box, box);
-      if (!all(le(isecleft.pmin, isecleft.pmax))) break;
-      const auto isecright = intersection(in->right->box, box);
-      if (!all(le(isecright.pmin, isecright.pmax))) break;
-      distr(in->left, pos, normaldist, dist, matindex, num, box);
-      arrayf tempdist;
-      loopi(num) tempdist[i] = FLT_MAX;
-      distr(in->right, pos, normaldist, tempdist, matindex, num, box);
-      loopi(num) {
-        dist[i] = max(dist[i], tempdist[i]);
-        matindex[i] = dist[i] >= 0.f ? MAT_AIR_INDEX : matindex[i];
+      break;
+      case OP_INTERSECTION_END: {
+        const auto &td = regs.d[ins.treg];
+        loopi(num) {
+          if (gg && td[i] > dd[i]) set(*gg, get(*tg,i), i);
+          dd[i] = max(dd[i], td[i]);
+          mm[i] = dd[i] >= 0.f ? MAT_AIR_INDEX : mm[i];
+        }
       }
-    }
-    break;
-    case C_DIFFERENCE: {
-      const auto d = static_cast<const D*>(n);
-      const auto isecleft = intersection(d->left->box, box);
-      if (!all(le(isecleft.pmin, isecleft.pmax))) break;
-      distr(d->left, pos, normaldist, dist, matindex, num, box);
-
-      const auto isecright = intersection(d->right->box, box);
-      if (!all(le(isecright.pmin, isecright.pmax))) break;
-      arrayf tempdist;
-      arrayi tempmatindex;
-      loopi(num) tempdist[i] = FLT_MAX;
-      distr(d->right, pos, normaldist, tempdist, tempmatindex, num, box);
-      loopi(num) {
-        dist[i] = max(dist[i], -tempdist[i]);
-        matindex[i] = dist[i] >= 0.f ? MAT_AIR_INDEX : matindex[i];
+      break;
+      case OP_DIFFERENCE:
+        pc = culled(ins.box, qbox) ? ins.end : pc+1;
+      continue;
+      case OP_DIFFERENCE_MID: {
+        if (culled(ins.rbox, qbox)) {
+          pc = ins.end;
+          continue;
+        }
+        auto &td = regs.d[ins.treg];
+        loopi(num) td[i] = FLT_MAX;
+        if (gg) loopi(num) set(*tg, vec3f(zero), i);
       }
-    }
-    break;
-    case C_TRANSLATION: {
-      const auto isec = intersection(n->box, box);
-      if (any(gt(isec.pmin, isec.pmax))) break;
-      const auto t = static_cast<const translation*>(n);
-      array3f tpos;
-      loopi(num) set(tpos, get(pos,i) - t->p, i);
-      const aabb tbox(box.pmin-t->p, box.pmax-t->p);
-      distr(t->n, tpos, normaldist, dist, matindex, num, tbox);
-    }
-    break;
-    case C_ROTATION: {
-      const auto isec = intersection(n->box, box);
-      if (any(gt(isec.pmin, isec.pmax))) break;
-      const auto r = static_cast<const rotation*>(n);
-      array3f tpos;
-      loopi(num) set(tpos, xfmpoint(conj(r->q), get(pos,i)), i);
-      distr(r->n, tpos, normaldist, dist, matindex, num, aabb::all());
-    }
-    break;
-    case C_PLANE: {
-      const auto isec = intersection(n->box, box);
-      if (any(gt(isec.pmin, isec.pmax))) break;
-      const auto p = static_cast<const plane*>(n);
-      loopi(num) {
-        dist[i] = dot(get(pos,i), p->p.xyz()) + p->p.w;
-        matindex[i] = dist[i] < 0.f ? p->matindex : matindex[i];
+      break;
+      case OP_DIFFERENCE_END: {
+        const auto &td = regs.d[ins.treg];
+        loopi(num) {
+          if (gg && -td[i] > dd[i]) set(*gg, -get(*tg,i), i);
+          dd[i] = max(dd[i], -td[i]);
+          mm[i] = dd[i] >= 0.f ? MAT_AIR_INDEX : mm[i];
+        }
       }
-    }
-    break;
+      break;
+      case OP_TRANSLATION: {
+        if (ins.cull && culled(ins.box, qbox)) {
+          pc = ins.end;
+          continue;
+        }
+        const auto tp = ins.p.xyz();
+        auto &tpos = regs.pos[ins.frame+1];
+        loopi(num) set(tpos, get(p,i) - tp, i);
+        regs.box[ins.frame+1] = aabb(qbox.pmin-tp, qbox.pmax-tp);
+      }
+      break;
+      case OP_ROTATION: {
+        if (ins.cull && culled(ins.box, qbox)) {
+          pc = ins.end;
+          continue;
+        }
+        const auto q = conj(ins.q);
+        auto &tpos = regs.pos[ins.frame+1];
+        loopi(num) set(tpos, xfmpoint(q, get(p,i)), i);
+        regs.box[ins.frame+1] = xfmbox(q, qbox);
+      }
+      break;
+      case OP_PLANE: {
+        if (ins.cull && culled(ins.box, qbox)) break;
+        loopi(num) {
+          dd[i] = dot(get(p,i), ins.p.xyz()) + ins.p.w;
+          mm[i] = dd[i] < 0.f ? ins.matindex : mm[i];
+        }
+        if (gg) loopi(num) set(*gg, world(ins, ins.p.xyz()), i);
+      }
+      break;
 
-#define CYL(NAME, COORD)\
-  case C_CYLINDER##NAME: {\
-    const auto isec = intersection(n->box, box);\
-    if (any(gt(isec.pmin, isec.pmax))) break;\
-    const auto c = static_cast<const cylinder##COORD*>(n);\
+#define CYL(NAME, COORD, GRAD)\
+  case OP_CYLINDER##NAME: {\
+    if (ins.cull && culled(ins.box, qbox)) break;\
+    const auto c = vec2f(ins.p.x, ins.p.y);\
     loopi(num) {\
-      dist[i] = length(get(pos,i).COORD()-c->c##COORD) - c->r;\
-      matindex[i] = dist[i] < 0.f ? c->matindex : matindex[i];\
+      const auto v = get(p,i).COORD()-c;\
+      const auto l = length(v);\
+      dd[i] = l - ins.p.z;\
+      mm[i] = dd[i] < 0.f ? ins.matindex : mm[i];\
+      if (gg) {\
+        const auto n = v*safercp(l);\
+        set(*gg, world(ins, GRAD), i);\
+      }\
     }\
   }\
   break;
-  CYL(XY,xy); CYL(XZ,xz); CYL(YZ,yz);
+  CYL(XY, xy, vec3f(n.x, n.y, 0.f));
+  CYL(XZ, xz, vec3f(n.x, 0.f, n.y));
+  CYL(YZ, yz, vec3f(0.f, n.x, n.y));
 #undef CYL
 
-    case C_SPHERE: {
-      const auto isec = intersection(n->box, box);
-      if (any(gt(isec.pmin, isec.pmax))) break;
-      const auto s = static_cast<const sphere*>(n);
-      loopi(num) {
-        dist[i] = length(get(pos,i)) - s->r;
-        matindex[i] = dist[i] < 0.f ? s->matindex : matindex[i];
+      case OP_SPHERE: {
+        if (ins.cull && culled(ins.box, qbox)) break;
+        loopi(num) {
+          const auto pp = get(p,i);
+          const auto l = length(pp);
+          dd[i] = l - ins.p.x;
+          mm[i] = dd[i] < 0.f ? ins.matindex : mm[i];
+          if (gg) set(*gg, world(ins, pp*safercp(l)), i);
+        }
       }
-    }
-    break;
-    case C_BOX: {
-      const auto isec = intersection(n->box, box);
-      if (any(gt(isec.pmin, isec.pmax))) break;
-      const auto b = static_cast<const struct box*>(n);
-      const auto extent = b->extent;
-      loopi(num) {
-        const auto pd = abs(get(pos,i))-extent;
-        dist[i] = min(max(pd.x,max(pd.y,pd.z)),0.0f) + length(max(pd,vec3f(zero)));
-        matindex[i] = dist[i] < 0.f ? b->matindex : matindex[i];
+      break;
+      case OP_BOX: {
+        if (ins.cull && culled(ins.box, qbox)) break;
+        const auto extent = ins.p.xyz();
+        loopi(num) {
+          const auto pp = get(p,i);
+          const auto pd = abs(pp)-extent;
+          const auto out = max(pd,vec3f(zero));
+          const auto l = length(out);
+          dd[i] = min(max(pd.x,max(pd.y,pd.z)),0.0f) + l;
+          mm[i] = dd[i] < 0.f ? ins.matindex : mm[i];
+          if (gg) {
+            auto n = out*safercp(l);
+            if (l == 0.f) {
+              const auto ax = pd.x>=pd.y && pd.x>=pd.z ? 0 : (pd.y>=pd.z ? 1 : 2);
+              n = vec3f(zero);
+              n[ax] = 1.f;
+            }
+            loopj(3) n[j] = pp[j] < 0.f ? -n[j] : n[j];
+            set(*gg, world(ins, n), i);
+          }
+        }
       }
+      break;
+      default: assert("unreachable" && false);
     }
-    break;
-    case C_EMPTY: break;
-    case C_INVALID: assert("unreachable" && false);
+    ++pc;
   }
 }
+} /* namespace scalar */
 
-void dist(const node *RESTRICT n, const array3f &RESTRICT pos,
-          const arrayf *RESTRICT normaldist, arrayf &RESTRICT d,
-          arrayi &RESTRICT mat, int num, const aabb &RESTRICT box)
-{
-  loopi(num) d[i] = FLT_MAX;
-  loopi(num) mat[i] = MAT_AIR_INDEX;
-  distr(n, pos, normaldist, d, mat, num, box);
+// union of the children below the given bvh node
+static float dist(const nary *n, u32 idx, const vec3f &pos, const aabb &box) {
+  const auto &b = n->bvh[idx];
+  if (culled(b.box, box)) return FLT_MAX;
+  if (b.child != bvhnode::INNER) return dist(n->children[b.child], pos, box);
+  const auto left = dist(n, idx+1, pos, box);
+  const auto right = dist(n, b.right, pos, box);
+  return min(left, right);
 }
 
 float dist(const node *n, const vec3f &pos, const aabb &box) {
@@ -208,13 +285,24 @@ float dist(const node *n, const vec3f &pos, const aabb &box) {
       const auto r = static_cast<const R*>(n);
       return dist(r->left, pos, box);
     }
+    case C_UNIONN: {
+      const auto u = static_cast<const unionn*>(n);
+      return u->bvh.length() != 0 ? dist(u, 0, pos, box) : FLT_MAX;
+    }
+    case C_DIFFERENCEN: {
+      const auto d = static_cast<const differencen*>(n);
+      const auto left = dist(d->left, pos, box);
+      const auto right = d->bvh.length() != 0 ? dist(d, 0, pos, box) : FLT_MAX;
+      return max(left,-right);
+    }
     case C_TRANSLATION: {
       const auto t = static_cast<const translation*>(n);
       return dist(t->n, pos-t->p, aabb(box.pmin-t->p, box.pmax-t->p));
     }
     case C_ROTATION: {
       const auto r = static_cast<const rotation*>(n);
-      return dist(r->n, xfmpoint(conj(r->q), pos), aabb::all());
+      const auto q = conj(r->q);
+      return dist(r->n, xfmpoint(q, pos), xfmbox(q, box));
     }
     case C_PLANE: {
       const auto p = static_cast<const plane*>(n);
@@ -245,6 +333,128 @@ float dist(const node *n, const vec3f &pos, const aabb &box) {
     default: assert("unreachable" && false); return FLT_MAX;
   }
 }
+/*--------------------------------------------------------------------------
+ - interval evaluation. nodes culled by the box are outside and far away
+ - exactly as in the point evaluation above
+ -------------------------------------------------------------------------*/
+static const intervalf OUTSIDE(FLT_MAX, FLT_MAX);
+
+static INLINE intervalf iabs(const intervalf &x) {
+  if (x.m >= 0.f) return x;
+  if (x.M <= 0.f) return -x;
+  return intervalf(0.f, max(-x.m, x.M));
+}
+static INLINE intervalf isqr(const intervalf &x) {
+  const auto a = iabs(x);
+  return intervalf(a.m*a.m, a.M*a.M);
+}
+static INLINE intervalf isqrt(const intervalf &x) {
+  return intervalf(sqrt(x.m), sqrt(x.M));
+}
+static INLINE intervalf imin(const intervalf &x, const intervalf &y) {
+  return intervalf(min(x.m,y.m), min(x.M,y.M));
+}
+static INLINE intervalf imax(const intervalf &x, const intervalf &y) {
+  return intervalf(max(x.m,y.m), max(x.M,y.M));
+}
+static INLINE intervalf iscale(const intervalf &x, float s) {
+  return s >= 0.f ? intervalf(x.m*s, x.M*s) : intervalf(x.M*s, x.m*s);
+}
+static INLINE intervalf ilength(const intervalf &x, const intervalf &y) {
+  return isqrt(isqr(x)+isqr(y));
+}
+static INLINE intervalf ilength(const intervalf &x, const intervalf &y,
+                                const intervalf &z) {
+  return isqrt(isqr(x)+isqr(y)+isqr(z));
+}
+static INLINE intervalf ioffset(const intervalf &x, float s) {
+  return intervalf(x.m+s, x.M+s);
+}
+
+static intervalf dist(const nary *n, u32 idx, const aabb &box) {
+  const auto &b = n->bvh[idx];
+  if (culled(b.box, box)) return OUTSIDE;
+  if (b.child != bvhnode::INNER) return dist(n->children[b.child], box);
+  return imin(dist(n, idx+1, box), dist(n, b.right, box));
+}
+
+intervalf dist(const node *n, const aabb &box) {
+  if (culled(box, n->box)) return OUTSIDE;
+  const auto p = makeinterval(box.pmin, box.pmax);
+  switch (n->type) {
+    case C_UNION: {
+      const auto u = static_cast<const U*>(n);
+      return imin(dist(u->left, box), dist(u->right, box));
+    }
+    case C_INTERSECTION: {
+      const auto i = static_cast<const I*>(n);
+      return imax(dist(i->left, box), dist(i->right, box));
+    }
+    case C_DIFFERENCE: {
+      const auto d = static_cast<const D*>(n);
+      return imax(dist(d->left, box), -dist(d->right, box));
+    }
+    case C_REPLACE: {
+      const auto r = static_cast<const R*>(n);
+      return dist(r->left, box);
+    }
+    case C_UNIONN: {
+      const auto u = static_cast<const unionn*>(n);
+      return u->bvh.length() != 0 ? dist(u, 0, box) : OUTSIDE;
+    }
+    case C_DIFFERENCEN: {
+      const auto d = static_cast<const differencen*>(n);
+      const auto left = dist(d->left, box);
+      const auto right = d->bvh.length() != 0 ? dist(d, 0, box) : OUTSIDE;
+      return imax(left, -right);
+    }
+    case C_TRANSLATION: {
+      const auto t = static_cast<const translation*>(n);
+      return dist(t->n, aabb(box.pmin-t->p, box.pmax-t->p));
+    }
+    case C_ROTATION: {
+      const auto r = static_cast<const rotation*>(n);
+      return dist(r->n, xfmbox(conj(r->q), box));
+    }
+    case C_PLANE: {
+      const auto pl = static_cast<const plane*>(n);
+      const auto d = iscale(p.x,pl->p.x) + iscale(p.y,pl->p.y) + iscale(p.z,pl->p.z);
+      return ioffset(d, pl->p.w);
+    }
+    case C_CYLINDERXZ: {
+      const auto c = static_cast<const cylinderxz*>(n);
+      const auto x = ioffset(p.x,-c->cxz.x), z = ioffset(p.z,-c->cxz.y);
+      return ioffset(ilength(x,z), -c->r);
+    }
+    case C_CYLINDERXY: {
+      const auto c = static_cast<const cylinderxy*>(n);
+      const auto x = ioffset(p.x,-c->cxy.x), y = ioffset(p.y,-c->cxy.y);
+      return ioffset(ilength(x,y), -c->r);
+    }
+    case C_CYLINDERYZ: {
+      const auto c = static_cast<const cylinderyz*>(n);
+      const auto y = ioffset(p.y,-c->cyz.x), z = ioffset(p.z,-c->cyz.y);
+      return ioffset(ilength(y,z), -c->r);
+    }
+    case C_SPHERE: {
+      const auto s = static_cast<const sphere*>(n);
+      return ioffset(ilength(p.x,p.y,p.z), -s->r);
+    }
+    case C_BOX: {
+      const auto &extent = static_cast<const struct box*>(n)->extent;
+      const auto dx = ioffset(iabs(p.x),-extent.x);
+      const auto dy = ioffset(iabs(p.y),-extent.y);
+      const auto dz = ioffset(iabs(p.z),-extent.z);
+      const auto inside = imin(imax(dx,imax(dy,dz)), intervalf(zero));
+      const auto outside = ilength(imax(dx,intervalf(zero)),
+                                   imax(dy,intervalf(zero)),
+                                   imax(dz,intervalf(zero)));
+      return inside + outside;
+    }
+    case C_EMPTY: return OUTSIDE;
+    default: assert("unreachable" && false); return OUTSIDE;
+  }
+}
 } /* namespace csg */
 } /* namespace q */
 
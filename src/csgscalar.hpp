@@ -10,6 +10,9 @@ namespace csg {
 // single point csg evaluation
 float dist(const node*, const vec3f&, const aabb &box = aabb::all());
 
+// guaranteed bounds of the distance field over the whole box
+intervalf dist(const node*, const aabb &box);
+
 INLINE void set(array3f &v, vec3f u, u32 idx) {
   v[0][idx]=u.x; v[1][idx]=u.y; v[2][idx]=u.z;
 }
@@ -18,7 +21,9 @@ INLINE vec3f get(const array3f &v, u32 idx) {
 }
 
 // many points csg evaluation
+namespace scalar {
 #include "csgdecl.hxx"
+} /* namespace scalar */
 } /* namespace csg */
 } /* namespace q */
 
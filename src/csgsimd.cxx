@@ -25,250 +25,340 @@ INLINE bool empty(const ssebox &box) {
   return (movemask(box.pmin>box.pmax)&0x7) != 0;
 }
 
-static void distr(const node *RESTRICT n, const array3f &RESTRICT pos,
-                  const arrayf *RESTRICT normaldist, arrayf &RESTRICT dist,
-                  arrayi &RESTRICT matindex, int packetnum,
-                  const ssebox & RESTRICT box)
+INLINE bool culled(const aabb &b0, const ssebox &b1) {
+  return empty(intersection(ssebox(b0), b1));
+}
+
+/*-------------------------------------------------------------------------
+ - gradient helpers. primitives output world space gradients directly: the
+ - instruction stores the rotation from the primitive frame to the world
+ -------------------------------------------------------------------------*/
+INLINE soa3f select(const soab &m, const soa3f &t, const soa3f &f) {
+  return soa3f(select(m,t.x,f.x), select(m,t.y,f.y), select(m,t.z,f.z));
+}
+INLINE soa3f world(const instruction &ins, const soa3f &g) {
+  return ins.rotated ? xfmvector(quat<soaf>(ins.q), g) : g;
+}
+INLINE soaf safercp(const soaf &x) {
+  return select(x>soaf(zero), soaf(one)/x, soaf(zero));
+}
+INLINE void copygrad(array3f *RESTRICT dst, const array3f *RESTRICT src, int packetnum) {
+  loopi(packetnum) sset(*dst, sget(*src,i), i);
+}
+INLINE void cleargrad(array3f *RESTRICT g, int packetnum) {
+  loopi(packetnum) sset(*g, soa3f(zero), i);
+}
+INLINE void takegrad(array3f *RESTRICT g, const array3f *RESTRICT t,
+                     const soab &took, int i) {
+  sset(*g, select(took, sget(*t,i), sget(*g,i)), i);
+}
+
+void dist(const program *RESTRICT prog, registers &RESTRICT regs,
+          const array3f &RESTRICT pos, const arrayf *RESTRICT normaldist,
+          arrayf &RESTRICT d, arrayi &RESTRICT mat, array3f *RESTRICT grad,
+          int num, const aabb &RESTRICT box)
 {
-  switch (n->type) {
-    case C_UNION: {
-      const auto u = static_cast<const U*>(n);
-      const auto isecleft = intersection(ssebox(u->left->box), box);
-      const auto isecright = intersection(ssebox(u->right->box), box);
-      const auto goleft = !empty(isecleft);
-      const auto goright = !empty(isecright);
-      if (goleft && goright) {
-        distr(u->left, pos, normaldist, dist, matindex, packetnum, box);
-        CACHE_LINE_ALIGNED arrayf tempdist;
-        CACHE_LINE_ALIGNED arrayi tempmatindex;
+  assert(regs.regnum >= prog->regnum && regs.framenum >= prog->framenum);
+  const auto packetnum = num/soaf::size + (num%soaf::size?1:0);
+  loopi(packetnum) {
+    store(&d[i*soaf::size], soaf(FLT_MAX));
+    store(&mat[i*soaf::size], soai(MAT_AIR_INDEX));
+  }
+  if (grad) cleargrad(grad, packetnum);
+  regs.box[0] = box;
+
+  const auto code = prog->code.begin();
+  const auto len = prog->code.length();
+  int pc = 0;
+  while (pc < len) {
+    const auto &ins = code[pc];
+    const auto qbox = ssebox(regs.box[ins.frame]);
+    const auto &p = ins.frame ? regs.pos[ins.frame] : pos;
+    auto &dd = ins.dreg ? regs.d[ins.dreg] : d;
+    auto &mm = ins.mreg ? regs.m[ins.mreg] : mat;
+    const auto gg = grad ? (ins.dreg ? regs.g+ins.dreg : grad) : NULL;
+    const auto tg = grad ? regs.g+ins.treg : NULL;
+    switch (ins.op) {
+      case OP_UNION: {
+        const auto goleft = !culled(ins.box, qbox);
+        const auto goright = !culled(ins.rbox, qbox);
+        pc = goleft ? pc+1 : (goright ? ins.mid : ins.end);
+      }
+      continue;
+      case OP_UNION_MID: {
+        if (culled(ins.rbox, qbox)) {
+          pc = ins.end;
+          continue;
+        }
+        auto &td = regs.d[ins.treg];
+        auto &tm = regs.m[ins.treg];
+
+        // when the left child is culled, the right child just goes on with
+        // our own results
+        if (culled(ins.box, qbox)) loopi(packetnum) {
+          const auto idx = i*soaf::size;
+          store(&td[idx], soaf::load(&dd[idx]));
+          store(&tm[idx], soai::load(&mm[idx]));
+        } else loopi(packetnum) {
+          const auto idx = i*soaf::size;
+          store(&td[idx], soaf(FLT_MAX));
+          store(&tm[idx], soai(MAT_AIR_INDEX));
+        }
+        if (gg) {
+          if (culled(ins.box, qbox))
+            copygrad(tg, gg, packetnum);
+          else
+            cleargrad(tg, packetnum);
+        }
+      }
+      break;
+      case OP_UNION_END: {
+        const auto &td = regs.d[ins.treg];
+        const auto &tm = regs.m[ins.treg];
+        if (culled(ins.box, qbox)) {
+          loopi(packetnum) {
+            const auto idx = i*soaf::size;
+            store(&dd[idx], soaf::load(&td[idx]));
+            store(&mm[idx], soai::load(&tm[idx]));
+          }
+          if (gg) copygrad(gg, tg, packetnum);
+        } else {
+          loopi(packetnum) {
+            const auto idx = i*soaf::size;
+            const auto old = soai::load(&mm[idx]);
+            const auto tmp = soai::load(&tm[idx]);
+            store(&mm[idx], select(old > tmp, old, tmp));
+          }
+          if (normaldist) loopi(packetnum) {
+            const auto idx = i*soaf::size;
+            const auto d = soaf::load(&dd[idx]);
+            const auto t = soaf::load(&td[idx]);
+            const auto nd = soaf::load(&(*normaldist)[idx]);
+            if (gg) takegrad(gg, tg, (abs(t)<nd) | (t<d), i);
+            store(&dd[idx], select(abs(t)<nd, t, min(d,t)));
+          } else loopi(packetnum) {
+            const auto idx = i*soaf::size;
+            const auto d = soaf::load(&dd[idx]);
+            const auto t = soaf::load(&td[idx]);
+            if (gg) takegrad(gg, tg, t<d, i);
+            store(&dd[idx], min(d,t));
+          }
+        }
+      }
+      break;
+      case OP_REPLACE:
+        pc = culled(ins.box, qbox) ? ins.end : pc+1;
+      continue;
+      case OP_REPLACE_MID: {
+        if (culled(ins.rbox, qbox)) {
+          pc = ins.end;
+          continue;
+        }
+        auto &td = regs.d[ins.treg];
+        auto &tm = regs.m[ins.treg];
         loopi(packetnum) {
           const auto idx = i*soaf::size;
-          store(&tempdist[idx], soaf(FLT_MAX));
-          store(&tempmatindex[idx], soai(MAT_AIR_INDEX));
+          store(&td[idx], soaf(FLT_MAX));
+          store(&tm[idx], soai(MAT_AIR_INDEX));
         }
-        distr(u->right, pos, normaldist, tempdist, tempmatindex, packetnum, box);
+        if (gg) cleargrad(tg, packetnum);
+      }
+      break;
+      case OP_REPLACE_END: {
+        const auto &td = regs.d[ins.treg];
+        const auto &tm = regs.m[ins.treg];
         loopi(packetnum) {
           const auto idx = i*soaf::size;
-          const auto old = soai::load(&matindex[idx]);
-          const auto tmp = soai::load(&tempmatindex[idx]);
-          const auto newindex = select(old > tmp, old, tmp);
-          store(&matindex[idx], newindex);
+          const auto d = soaf::load(&dd[idx]);
+          const auto t = soaf::load(&td[idx]);
+          const auto insideright = (t<soaf(zero)) & (d<soaf(zero));
+          const auto tmpindex = soai::load(&tm[idx]);
+          const auto oldindex = soai::load(&mm[idx]);
+          store(&mm[idx], select(insideright, tmpindex, oldindex));
         }
         if (normaldist) loopi(packetnum) {
           const auto idx = i*soaf::size;
-          const auto d = soaf::load(&dist[idx]);
-          const auto td = soaf::load(&tempdist[idx]);
+          const auto d = soaf::load(&dd[idx]);
+          const auto t = soaf::load(&td[idx]);
           const auto nd = soaf::load(&(*normaldist)[idx]);
-          const auto mtd = min(d, td);
-          const auto sd = select(abs(td)<nd, td, mtd);
-          store(&dist[idx], sd);
-        } else loopi(packetnum) {
+          const auto took = (d<soaf(zero)) & (abs(t)<nd);
+          if (gg) takegrad(gg, tg, took, i);
+          store(&dd[idx], select(took, t, d));
+        }
+      }
+      break;
+      case OP_INTERSECTION:
+        pc = culled(ins.box, qbox) || culled(ins.rbox, qbox) ? ins.end : pc+1;
+      continue;
+      case OP_INTERSECTION_MID: {
+        auto &td = regs.d[ins.treg];
+        loopi(packetnum) store(&td[i*soaf::size], soaf(FLT_MAX));
+        if (gg) cleargrad(tg, packetnum);
+      }
+      break;
+      case OP_INTERSECTION_END: {
+        const auto &td = regs.d[ins.treg];
+        loopi(packetnum) {
           const auto idx = i*soaf::size;
-          const auto d = soaf::load(&dist[idx]);
-          const auto td = soaf::load(&tempdist[idx]);
-          store(&dist[idx], min(d,td));
+          const auto d = soaf::load(&dd[idx]);
+          const auto t = soaf::load(&td[idx]);
+          const auto md = max(d,t);
+          const auto oldindex = soai::load(&mm[idx]);
+          const auto airindex = soai(MAT_AIR_INDEX);
+          if (gg) takegrad(gg, tg, t>d, i);
+          store(&dd[idx], md);
+          store(&mm[idx], select(md>=soaf(zero), airindex, oldindex));
         }
-      } else if (goleft)
-        distr(u->left, pos, normaldist, dist, matindex, packetnum, box);
-      else if (goright)
-        distr(u->right, pos, normaldist, dist, matindex, packetnum, box);
-    }
-    break;
-    case C_REPLACE: {
-      const auto r = static_cast<const R*>(n);
-      const auto isecleft = intersection(ssebox(r->left->box), box);
-      const auto goleft = !empty(isecleft);
-      if (!goleft) return;
-      distr(r->left, pos, normaldist, dist, matindex, packetnum, box);
-      const auto isecright = intersection(ssebox(r->right->box), box);
-      const auto goright = !empty(isecright);
-      if (!goright) return;
-      CACHE_LINE_ALIGNED arrayf tempdist;
-      CACHE_LINE_ALIGNED arrayi tempmatindex;
-      loopi(packetnum) {
-        const auto idx = i*soaf::size;
-        store(&tempdist[idx], soaf(FLT_MAX));
-        store(&tempmatindex[idx], soai(MAT_AIR_INDEX));
       }
-      distr(r->right, pos, normaldist, tempdist, tempmatindex, packetnum, box);
-      loopi(packetnum) {
-        const auto idx = i*soaf::size;
-        const auto d = soaf::load(&dist[idx]);
-        const auto td = soaf::load(&tempdist[idx]);
-        const auto insideright = (td<soaf(zero)) & (d<soaf(zero));
-        const auto tmpindex = soai::load(&tempmatindex[idx]);
-        const auto oldindex = soai::load(&matindex[idx]);
-        const auto newindex = select(insideright, tmpindex, oldindex);
-        store(&matindex[idx], newindex);
+      break;
+      case OP_DIFFERENCE:
+        pc = culled(ins.box, qbox) ? ins.end : pc+1;
+      continue;
+      case OP_DIFFERENCE_MID: {
+        if (culled(ins.rbox, qbox)) {
+          pc = ins.end;
+          continue;
+        }
+        auto &td = regs.d[ins.treg];
+        loopi(packetnum) store(&td[i*soaf::size], soaf(FLT_MAX));
+        if (gg) cleargrad(tg, packetnum);
       }
-      if (normaldist) loopi(packetnum) {
+      break;
+      case OP_DIFFERENCE_END: {
+        const auto &td = regs.d[ins.treg];
+        loopi(packetnum) {
           const auto idx = i*soaf::size;
-          const auto d = soaf::load(&dist[idx]);
-          const auto td = soaf::load(&tempdist[idx]);
-          const auto nd = soaf::load(&(*normaldist)[idx]);
-          const auto sd = select((d<soaf(zero)) & (abs(td)<nd), td, d);
-          store(&dist[idx], sd);
+          const auto d = soaf::load(&dd[idx]);
+          const auto t = soaf::load(&td[idx]);
+          const auto md = max(d,-t);
+          const auto oldindex = soai::load(&mm[idx]);
+          const auto airindex = soai(MAT_AIR_INDEX);
+          if (gg) sset(*gg, select(-t>d, -sget(*tg,i), sget(*gg,i)), i);
+          store(&dd[idx], md);
+          store(&mm[idx], select(md>=soaf(zero), airindex, oldindex));
+        }
       }
-    }
-    break;
-    case C_INTERSECTION: {
-      const auto in = static_cast<const I*>(n);
-      const auto isecleft = intersection(ssebox(in->left->box), box);
-      if (empty(isecleft)) return;
-      const auto isecright = intersection(ssebox(in->right->box), box);
-      if (empty(isecright)) return;
-      distr(in->left, pos, normaldist, dist, matindex, packetnum, box);
-      CACHE_LINE_ALIGNED arrayf tempdist;
-      loopi(packetnum) store(&tempdist[i*soaf::size], soaf(FLT_MAX));
-      distr(in->right, pos, normaldist, tempdist, matindex, packetnum, box);
-      loopi(packetnum) {
-        const auto idx = i*soaf::size;
-        const auto d = soaf::load(&dist[idx]);
-        const auto td = soaf::load(&tempdist[idx]);
-        const auto md = max(d,td);
-        const auto oldindex = soai::load(&matindex[idx]);
-        const auto airindex = soai(MAT_AIR_INDEX);
-        const auto newindex = select(md>=soaf(zero), airindex, oldindex);
-        store(&dist[idx], md);
-        store(&matindex[idx], newindex);
+      break;
+      case OP_TRANSLATION: {
+        if (ins.cull && culled(ins.box, qbox)) {
+          pc = ins.end;
+          continue;
+        }
+        const auto p3 = ins.p.xyz();
+        const auto tp = soa3f(p3);
+        auto &tpos = regs.pos[ins.frame+1];
+        loopi(packetnum) sset(tpos, sget(p,i) - tp, i);
+        const auto &b = regs.box[ins.frame];
+        regs.box[ins.frame+1] = aabb(b.pmin-p3, b.pmax-p3);
       }
-    }
-    break;
-    case C_DIFFERENCE: {
-      const auto d = static_cast<const D*>(n);
-      const auto isecleft = intersection(ssebox(d->left->box), box);
-      if (empty(isecleft)) break;
-      distr(d->left, pos, normaldist, dist, matindex, packetnum, box);
-
-      const auto isecright = intersection(ssebox(d->right->box), box);
-      if (empty(isecright)) break;
-      CACHE_LINE_ALIGNED arrayf tempdist;
-      CACHE_LINE_ALIGNED arrayi tempmatindex;
-      loopi(packetnum) store(&tempdist[i*soaf::size], soaf(FLT_MAX));
-      distr(d->right, pos, normaldist, tempdist, tempmatindex, packetnum, box);
-      loopi(packetnum) {
-        const auto idx = i*soaf::size;
-        const auto d = soaf::load(&dist[idx]);
-        const auto td = soaf::load(&tempdist[idx]);
-        const auto md = max(d,-td);
-        const auto oldindex = soai::load(&matindex[idx]);
-        const auto airindex = soai(MAT_AIR_INDEX);
-        const auto newindex = select(md>=soaf(zero), airindex, oldindex);
-        store(&dist[idx], md);
-        store(&matindex[idx], newindex);
+      break;
+      case OP_ROTATION: {
+        if (ins.cull && culled(ins.box, qbox)) {
+          pc = ins.end;
+          continue;
+        }
+        const auto rq = quat<soaf>(conj(ins.q));
+        auto &tpos = regs.pos[ins.frame+1];
+        loopi(packetnum) sset(tpos, xfmpoint(rq, sget(p,i)), i);
+        regs.box[ins.frame+1] = xfmbox(conj(ins.q), regs.box[ins.frame]);
       }
-    }
-    break;
-    case C_TRANSLATION: {
-      const auto isec = intersection(ssebox(n->box), box);
-      if (empty(isec)) break;
-      const auto t = static_cast<const translation*>(n);
-      const auto tp = soa3f(t->p);
-      CACHE_LINE_ALIGNED array3f tpos;
-      loopi(packetnum) sset(tpos, sget(pos,i) - tp, i);
-      const auto ssep = ssef::loadu(&t->p);
-      const ssebox tbox(box.pmin-ssep, box.pmax-ssep);
-      distr(t->n, tpos, normaldist, dist, matindex, packetnum, tbox);
-    }
-    break;
-    case C_ROTATION: {
-      const auto isec = intersection(ssebox(n->box), box);
-      if (empty(isec)) break;
-      const auto r = static_cast<const rotation*>(n);
-      const auto rq = quat<soaf>(conj(r->q));
-      CACHE_LINE_ALIGNED array3f tpos;
-      loopi(packetnum) sset(tpos, xfmpoint(rq, sget(pos,i)), i);
-      distr(r->n, tpos, normaldist, dist, matindex, packetnum, aabb::all());
-    }
-    break;
-    case C_PLANE: {
-      const auto isec = intersection(ssebox(n->box), box);
-      if (empty(isec)) break;
-      const auto p = static_cast<const plane*>(n);
-      const auto pp = soa3f(p->p.xyz());
-      const auto d = soaf(p->p.w);
-      loopi(packetnum) {
-        const auto idx = i*soaf::size;
-        const auto nd = dot(sget(pos,i), pp) + d;
-        const auto oldindex = soai::load(&matindex[idx]);
-        const auto newindex = soai(p->matindex);
-        const auto m = nd<soaf(zero);
-        store(&dist[idx], nd);
-        store(&matindex[idx], select(m, newindex, oldindex));
+      break;
+      case OP_PLANE: {
+        if (ins.cull && culled(ins.box, qbox)) break;
+        const auto pp = soa3f(ins.p.xyz());
+        const auto pd = soaf(ins.p.w);
+        const auto newindex = soai(ins.matindex);
+        loopi(packetnum) {
+          const auto idx = i*soaf::size;
+          const auto nd = dot(sget(p,i), pp) + pd;
+          const auto oldindex = soai::load(&mm[idx]);
+          store(&dd[idx], nd);
+          store(&mm[idx], select(nd<soaf(zero), newindex, oldindex));
+        }
+        if (gg) {
+          const auto n = world(ins, pp);
+          loopi(packetnum) sset(*gg, n, i);
+        }
       }
-    }
-    break;
+      break;
 
-#define CYL(NAME, COORD)\
-  case C_CYLINDER##NAME: {\
-    const auto isec = intersection(ssebox(n->box), box);\
-    if (empty(isec)) break;\
-    const auto c = static_cast<const cylinder##COORD*>(n);\
-    const auto cc = soa2f(c->c##COORD);\
-    const auto r = soaf(c->r);\
+#define CYL(NAME, COORD, GRAD)\
+  case OP_CYLINDER##NAME: {\
+    if (ins.cull && culled(ins.box, qbox)) break;\
+    const auto cc = soa2f(vec2f(ins.p.x, ins.p.y));\
+    const auto r = soaf(ins.p.z);\
+    const auto newindex = soai(ins.matindex);\
     loopi(packetnum) {\
       const auto idx = i*soaf::size;\
-      const auto p = sget(pos,i).COORD();\
-      const auto nd = length(p - cc) - r;\
-      const auto oldindex = soai::load(&matindex[idx]);\
-      const auto newindex = soai(c->matindex);\
-      const auto m = nd<soaf(zero);\
-      store(&dist[idx], nd);\
-      store(&matindex[idx], select(m, newindex, oldindex));\
+      const auto v = sget(p,i).COORD() - cc;\
+      const auto l = length(v);\
+      const auto nd = l - r;\
+      const auto oldindex = soai::load(&mm[idx]);\
+      store(&dd[idx], nd);\
+      store(&mm[idx], select(nd<soaf(zero), newindex, oldindex));\
+      if (gg) {\
+        const auto n = v*safercp(l);\
+        sset(*gg, world(ins, GRAD), i);\
+      }\
     }\
   }\
   break;
-  CYL(XY,xy); CYL(XZ,xz); CYL(YZ,yz);
+  CYL(XY, xy, soa3f(n.x, n.y, soaf(zero)));
+  CYL(XZ, xz, soa3f(n.x, soaf(zero), n.y));
+  CYL(YZ, yz, soa3f(soaf(zero), n.x, n.y));
 #undef CYL
 
-    case C_SPHERE: {
-      const auto isec = intersection(ssebox(n->box), box);
-      if (empty(isec)) break;
-      const auto s = static_cast<const sphere*>(n);
-      const auto r = soaf(s->r);
-      loopi(packetnum) {
-        const auto idx = i*soaf::size;
-        const auto oldindex = soai::load(&matindex[idx]);
-        const auto newindex = soai(s->matindex);
-        const auto nd = length(sget(pos,i)) - r;
-        const auto m = nd<soaf(zero);
-        store(&dist[idx], nd);
-        store(&matindex[idx], select(m, newindex, oldindex));
+      case OP_SPHERE: {
+        if (ins.cull && culled(ins.box, qbox)) break;
+        const auto r = soaf(ins.p.x);
+        const auto newindex = soai(ins.matindex);
+        loopi(packetnum) {
+          const auto idx = i*soaf::size;
+          const auto pp = sget(p,i);
+          const auto l = length(pp);
+          const auto nd = l - r;
+          const auto oldindex = soai::load(&mm[idx]);
+          store(&dd[idx], nd);
+          store(&mm[idx], select(nd<soaf(zero), newindex, oldindex));
+          if (gg) sset(*gg, world(ins, pp*safercp(l)), i);
+        }
       }
-    }
-    break;
-    case C_BOX: {
-      const auto isec = intersection(ssebox(n->box), box);
-      if (empty(isec)) break;
-      const auto b = static_cast<const struct box*>(n);
-      const auto extent = soa3f(b->extent);
-      loopi(packetnum) {
-        const auto idx = i*soaf::size;
-        const auto oldindex = soai::load(&matindex[idx]);
-        const auto newindex = soai(b->matindex);
-        const auto pd = abs(sget(pos,i))-extent;
-        const auto nd = min(max(pd.x,max(pd.y,pd.z)),soaf(zero)) + length(max(pd,soa3f(zero)));
-        const auto m = nd<soaf(zero);
-        store(&dist[idx], nd);
-        store(&matindex[idx], select(m, newindex, oldindex));
+      break;
+      case OP_BOX: {
+        if (ins.cull && culled(ins.box, qbox)) break;
+        const auto extent = soa3f(ins.p.xyz());
+        const auto newindex = soai(ins.matindex);
+        loopi(packetnum) {
+          const auto idx = i*soaf::size;
+          const auto pp = sget(p,i);
+          const auto pd = abs(pp)-extent;
+          const auto out = max(pd,soa3f(zero));
+          const auto l = length(out);
+          const auto nd = min(max(pd.x,max(pd.y,pd.z)),soaf(zero)) + l;
+          const auto oldindex = soai::load(&mm[idx]);
+          store(&dd[idx], nd);
+          store(&mm[idx], select(nd<soaf(zero), newindex, oldindex));
+          if (gg) {
+            // outside, we go along the closest point direction. inside, we
+            // go along the axis of the closest face
+            const auto mx = (pd.x>=pd.y) & (pd.x>=pd.z);
+            const auto my = andnot(mx, pd.y>=pd.z);
+            const auto mz = !(mx|my);
+            const auto o = soaf(one), z = soaf(zero);
+            const auto in = soa3f(select(mx,o,z), select(my,o,z), select(mz,o,z));
+            const auto n = select(l>z, out*safercp(l), in);
+            const auto g = soa3f(select(pp.x<z, -n.x, n.x),
+                                 select(pp.y<z, -n.y, n.y),
+                                 select(pp.z<z, -n.z, n.z));
+            sset(*gg, world(ins, g), i);
+          }
+        }
       }
+      break;
+      default: assert("unreachable" && false);
     }
-    break;
-    case C_EMPTY: break;
-    case C_INVALID: assert("unreachable" && false);
-  }
-}
-
-void dist(const node *RESTRICT n, const array3f &RESTRICT pos,
-          const arrayf *RESTRICT normaldist, arrayf &RESTRICT d,
-          arrayi &RESTRICT mat, int num, const aabb &RESTRICT box)
-{
-  const auto packetnum = num/soaf::size + (num%soaf::size?1:0);
-  loopi(packetnum) {
-    store(&d[i*soaf::size], soaf(FLT_MAX));
-    store(&mat[i*soaf::size], soai(MAT_AIR_INDEX));
+    ++pc;
   }
-  distr(n, pos, normaldist, d, mat, packetnum, ssebox(box));
   AVX_ZERO_UPPER();
 }
 } /* namespace NAMESPACE */
@@ -7,6 +7,9 @@
 #include "iso.hpp"
 #include "base/task.hpp"
 #include "base/vector.hpp"
+#include "base/algorithm.hpp"
+#include "base/hash_map.hpp"
+#include "base/hash.hpp"
 #include "base/console.hpp"
 
 namespace q {
@@ -16,6 +19,14 @@ template <typename T>
 INLINE bool isdegenerated(T a, T b, T c) { return a==b || a==c || b==c; }
 
 void mesh::destroy() {
+  if (m_map) {
+    sys::unmapfile(m_map, m_mapsize);
+    m_pos = m_nor = NULL;
+    m_index = NULL;
+    m_segment = NULL;
+    m_map = NULL;
+    return;
+  }
   if (m_pos) {FREE(m_pos); m_pos=NULL;}
   if (m_nor) {FREE(m_nor); m_nor=NULL;}
   if (m_index) {FREE(m_index); m_index=NULL;}
@@ -37,6 +48,12 @@ static const float MIN_EDGE_FACTOR = 1.f/8.f;
 // number of iterations of decimations
 static const u32 DECIMATION_NUM = 2;
 
+// level of details k works with cells of size 2^(k-1). it collapses edges
+// smaller than LOD_EDGE_FACTOR cell and accepts distance errors of about
+// LOD_ERROR_FACTOR cell
+static const float LOD_EDGE_FACTOR = 1.f;
+static const float LOD_ERROR_FACTOR = 0.25f;
+
 // we have to choose between this two meshes and take the one that does not self
 // intersect
 struct quadmesh { int tri[2][3]; };
@@ -56,56 +73,149 @@ static INLINE const quadmesh &findbestmesh(iso::octree::qefpoint **pt) {
 }
 
 /*-------------------------------------------------------------------------
- - build a regular "to-process" mesh from the qef points and quads
+ - build a regular "to-process" mesh from the qef points and quads. the mesh
+ - is built per chunk i.e. per octree subtree. quads that use points of
+ - another chunk are seams and are stitched once all chunks are done. points
+ - on the border of a chunk are locked such that seams can still use them
  -------------------------------------------------------------------------*/
 struct procmesh {
   vector<vec3f> pos, nor;
   vector<u32> idx, mat;
   vector<int> vidx;
   vector<pair<int,int>> vtri;
+  vector<int> key; // per vertex index in the locked point list or -1
   INLINE int trinum() const {return idx.length()/3;}
+  INLINE void destroy() {
+    pos.destroy();
+    nor.destroy();
+    idx.destroy();
+    mat.destroy();
+    key.destroy();
+  }
+  INLINE bool locked(int vert) const {return key[vert] != -1;}
 };
 
-static void buildmesh(const iso::octree &o, const iso::octree::node &node, procmesh &pm) {
-  if (!node.isleaf) {
-    loopi(8) buildmesh(o, node.children[i], pm);
-    return;
-  } else if (node.leaf == NULL)
-    return;
+struct seamquad {
+  vec3i pos[4];
+  u32 mat;
+};
 
-#if DEBUGOCTREE
-  bool missingpoint = false;
-#endif /* DEBUGOCTREE */
+// points used by several chunks are tagged before the chunk is built. with a
+// sink, they then become seam vertices when the chunk is emitted
+static const u32 BORDERPOINT = ~1u, SEAMPOINT = ~2u;
+static const int BORDERWIDTH = 2;
 
-  loopv(node.leaf->quads) {
-    // get four points
-    const auto &q = node.leaf->quads[i];
-    const auto quadmat = q.matindex;
-    iso::octree::qefpoint *pt[4];
-    loopk(4) {
-      const auto ipos = vec3i(q.index[k]) + node.org;
-      const auto leaf = o.findleaf(ipos);
+INLINE u64 cellkey(const vec3i &p) {
+  return u64(p.x) | (u64(p.y)<<21) | (u64(p.z)<<42);
+}
 
+struct meshchunk {
+  INLINE meshchunk(iso::octree::node &root, u32 dim, u32 id) :
+    root(root), pmin(root.org), pmax(root.org+int(dim>>root.level)),
+    dim(dim), id(id) {}
+  INLINE bool inside(const vec3i &p) const {
+    return all(ge(p,pmin)) && all(lt(p,pmax));
+  }
+  // leaves output quads up to two cells beyond their upper faces. no other
+  // chunk can exist beyond the boundary of the grid
+  INLINE bool border(int x, int axis) const {
+    return (x < pmin[axis]+BORDERWIDTH && pmin[axis] != 0) ||
+           (x >= pmax[axis]-BORDERWIDTH && pmax[axis] != int(dim));
+  }
+  procmesh pm, lod; // lod is the base of the next level of details
+  vector<iso::octree::qefpoint*> locked;
+  vector<pair<vec3i,iso::octree::qefpoint*>> bordercells;
+  vector<seamquad> seams;
+  iso::octree::node &root;
+  vec3i pmin, pmax;
+  u32 dim, id;
+};
+
+struct meshbuilder {
+  INLINE meshbuilder(iso::octree &o, float cellsize, meshsink sink,
+                     void *udata, u32 lodnum) :
+    o(o), cellsize(cellsize), mutex(SDL_CreateMutex()),
+    sink(sink), udata(udata), lodnum(lodnum) {}
+  ~meshbuilder() {
+    loopv(chunks) DEL(chunks[i]);
+    SDL_DestroyMutex(mutex);
+  }
+  iso::octree &o;
+  float cellsize;
+  SDL_mutex *mutex;
+  vector<meshchunk*> chunks;
+
+  // chunked output only. seams are resolved with the border cells of emitted
+  // chunks since their leaves are already gone
+  meshsink sink;
+  void *udata;
+  u32 lodnum;
+  hash_map<u64,u32> border;
+  vector<vec3f> seampos, seamnor;
+};
+
+static iso::octree::qefpoint *getpoint(const iso::octree &o, const vec3i &ipos) {
+  const auto leaf = o.findleaf(ipos);
 #if DEBUGOCTREE
-      if (leaf == NULL || leaf->leaf == NULL) {
-        missingpoint = true;
-        break;
-      }
+  if (leaf == NULL || leaf->leaf == NULL) return NULL;
 #else
-      assert(leaf != NULL && leaf->leaf != NULL &&
-        "leaf node is missing from the octree");
+  assert(leaf != NULL && leaf->leaf != NULL &&
+    "leaf node is missing from the octree");
 #endif /* DEBUGOCTREE */
+  const auto vidx = ipos % vec3i(iso::SUBGRID);
+  const auto qef = leaf->leaf->get(vidx);
+  assert(qef != NULL && "point is missing from leaf octree");
+  return qef;
+}
 
-      const auto vidx = ipos % vec3i(iso::SUBGRID);
-      const auto qef = leaf->leaf->get(vidx);
-      assert(qef != NULL && "point is missing from leaf octree");
-      pt[k] = qef;
+// one point may be shared by several cells. we first tag all points with at
+// least one cell on the chunk border
+static void markborder(const iso::octree::node &node, meshchunk &c, bool record) {
+  if (!node.isleaf) {
+    loopi(8) markborder(node.children[i], c, record);
+    return;
+  } else if (node.leaf == NULL)
+    return;
+  const auto sub = int(iso::SUBGRID);
+  loopi(3) loopj(2*BORDERWIDTH) {
+    const auto layer = j < BORDERWIDTH ? j : sub-2*BORDERWIDTH+j;
+    if (!c.border(node.org[i]+layer, i)) continue;
+    const auto u = (i+1)%3, v = (i+2)%3;
+    loopk(sub) loopl(sub) {
+      vec3i xyz;
+      xyz[i] = layer; xyz[u] = k; xyz[v] = l;
+      const auto qef = node.leaf->get(xyz);
+      if (qef == NULL) continue;
+      qef->chunk = BORDERPOINT;
+      if (record) c.bordercells.add(makepair(node.org+xyz, qef));
     }
+  }
+}
 
-#if DEBUGOCTREE
-    if (missingpoint)
+static void buildmesh(const iso::octree &o, const iso::octree::node &node, meshchunk &c) {
+  if (!node.isleaf) {
+    loopi(8) buildmesh(o, node.children[i], c);
+    return;
+  } else if (node.leaf == NULL)
+    return;
+
+  auto &pm = c.pm;
+  loopi(node.leaf->quadnum) {
+    // get four points. quads going out of the chunk are seams
+    const auto &q = node.leaf->quads[i];
+    const auto quadmat = q.matindex;
+    vec3i ipos[4];
+    loopk(4) ipos[k] = vec3i(q.index[k]) + node.org;
+    if (!c.inside(ipos[0]) || !c.inside(ipos[1]) ||
+        !c.inside(ipos[2]) || !c.inside(ipos[3])) {
+      c.seams.add({{ipos[0],ipos[1],ipos[2],ipos[3]},quadmat});
       continue;
-#endif /* DEBUGOCTREE */
+    }
+
+    iso::octree::qefpoint *pt[4];
+    bool missingpoint = false;
+    loopk(4) if ((pt[k] = getpoint(o, ipos[k])) == NULL) missingpoint = true;
+    if (missingpoint) continue;
 
     // get the right convex configuration
     const auto tri = findbestmesh(pt).tri;
@@ -121,6 +231,12 @@ static void buildmesh(const iso::octree &o, const iso::octree::node &node, procm
         if (qef->idx == -1) {
           qef->idx = pm.pos.length();
           pm.pos.add(qef->pos);
+          if (qef->chunk == BORDERPOINT) {
+            pm.key.add(c.locked.length());
+            c.locked.add(qef);
+          } else
+            pm.key.add(-1);
+          qef->chunk = c.id;
         }
         pm.idx.add(qef->idx);
       }
@@ -133,7 +249,7 @@ static void buildmesh(const iso::octree &o, const iso::octree::node &node, procm
  -------------------------------------------------------------------------*/
 struct qemedge {
   INLINE qemedge() {}
-  INLINE qemedge(int i0, int i1, int mat) : mat(mat), best(0), num(1) {
+  INLINE qemedge(int i0, int i1, int mat) : mat(mat), best(0), queued(0), num(1) {
     idx[0] = i0;
     idx[1] = i1;
     timestamp[0] = timestamp[1] = 0;
@@ -142,7 +258,8 @@ struct qemedge {
   int timestamp[2];
   int mat;
   int best:1;
-  int num:31;
+  u32 queued:1; // edge is in the heap
+  int num:30;   // number of triangles using the edge
 };
 
 struct qemheapitem {
@@ -158,15 +275,33 @@ INLINE bool operator< (const qemheapitem &i0, const qemheapitem &i1) {
     return i0.cost < i1.cost;
 }
 
+// corner table: corner c is the vertex c%3 of triangle c/3. all corners of a
+// vertex are linked in a circular list and each corner knows the edge opposite
+// to it. a collapse only touches the ring of the removed vertex
+struct qemcorner {
+  int vert;       // vertex of the corner
+  int next, prev; // ring of corners around the same vertex
+  int edge;       // edge opposite to the corner
+};
+
 struct qemcontext {
-  vector<int> vidx;          // list of triangle per vertex
-  vector<pair<int,int>> vtri;// <trinum, firstidx> triangle list per vertex
+  vector<int> vcorner;       // one corner per vertex (-1 if no triangle left)
+  vector<int> vmark;         // vertex marks used by the link condition
+  vector<qemcorner> corner;  // corner table
   vector<qef::qem> vqem;     // qem per vertex
   vector<qemedge> eqem;      // qem information per edge
   vector<qemheapitem> heap;  // heap to decimate the mesh
-  vector<int> mergelist;     // temporary structure when merging triangle lists
+  vector<int> ring;          // temporary copy of the ring of a vertex
+  vector<pair<int,int>> remap; // temporary edge remapping when collapsing
+  vector<int> killed;        // temporary list of edges of removed triangles
+  double maxerror;           // we do not merge edges beyond this error
+  float maxedgelen;          // we do not merge edges beyond this length
+  int mark;                  // current vertex mark
 };
 
+INLINE int nextcorner(int c) { return c%3 == 2 ? c-2 : c+1; }
+INLINE int prevcorner(int c) { return c%3 == 0 ? c+2 : c-1; }
+
 static void extraplane(const procmesh &pm, const qemedge &edge, int tri,
                        qef::qem &q0, qef::qem &q1)
 {
@@ -192,6 +327,7 @@ static void extraplane(const procmesh &pm, const qemedge &edge, int tri,
 static void buildedges(qemcontext &ctx, const procmesh &pm) {
   auto &e = ctx.eqem;
   auto &v = ctx.vqem;
+  auto &c = ctx.corner;
 
   // maintain a list of edges per triangle
   const auto vertnum = pm.pos.length(), trinum = pm.trinum();
@@ -199,7 +335,8 @@ static void buildedges(qemcontext &ctx, const procmesh &pm) {
   loopi(vertnum) vlist[i] = -1;
   int firstedge = vertnum;
 
-  // first append all edges with i0 < i1
+  // first append all edges with i0 < i1. edge (t[j-1],t[j]) is opposite to
+  // corner j+1
   loopi(trinum) {
     const auto mat = pm.mat[i];
     const auto t = &pm.idx[3*i];
@@ -209,6 +346,7 @@ static void buildedges(qemcontext &ctx, const procmesh &pm) {
       if (i0 < i1) {
         vlist[firstedge++] = vlist[i0];
         vlist[i0] = e.length();
+        c[nextcorner(3*i+j)].edge = e.length();
         e.add(qemedge(i0,i1,mat));
       }
       i0 = i1;
@@ -234,11 +372,13 @@ static void buildedges(qemcontext &ctx, const procmesh &pm) {
         if (idx == -1) {
           vlist[firstedge++] = vlist[i1];
           vlist[i1] = e.length();
+          c[nextcorner(3*i+j)].edge = e.length();
           e.add(qemedge(i1,i0,mat));
           extraplane(pm, e.last(), i, v[i0], v[i1]);
         } else {
           auto &edge = e[idx];
           ++edge.num;
+          c[nextcorner(3*i+j)].edge = idx;
 
           // is it a multi-material edge? if so, add a plane to separate both
           // materials
@@ -279,84 +419,146 @@ static void buildheap(qemcontext &ctx, procmesh &pm) {
     const auto &p0 = p[idx0], &p1 = p[idx1];
     const auto &q0 = v[idx0], &q1 = v[idx1];
     const auto best = qef::findbest(q0,q1,p0,p1,QEM_MIN_ERROR);
-    if (best.first > QEM_MIN_ERROR)
+    if (best.first > ctx.maxerror)
       continue;
     e[i].best = best.second;
+    e[i].queued = 1;
     h.add({best.first,distance2(p0,p1),i});
   }
   h.buildheap();
 }
 
-INLINE int uncollapsedidx(vector<qef::qem> &v, int idx) {
-  while (v[idx].next != -1) idx = v[idx].next;
-  return idx;
+static void unlinkcorner(qemcontext &ctx, int c) {
+  auto &corner = ctx.corner;
+  const auto next = corner[c].next, prev = corner[c].prev;
+  auto &first = ctx.vcorner[corner[c].vert];
+  if (first == c) first = next == c ? -1 : next;
+  corner[prev].next = next;
+  corner[next].prev = prev;
+  corner[c].next = corner[c].prev = -1;
 }
 
 static bool merge(qemcontext &ctx, procmesh &pm, const qemedge &edge, int idx0, int idx1) {
+  // seams may use locked vertices. we cannot move them
+  if (pm.locked(idx0) || pm.locked(idx1)) return false;
 
-  // first we gather non degenerated triangles from both vertex triangle lists
-  ctx.mergelist.setsize(0);
-  const int idx[] = {idx0,idx1}, other[] = {idx1,idx0};
-  int pivot;
-  loopi(2) {
-    const auto first = ctx.vtri[idx[i]].first;
-    const auto n = ctx.vtri[idx[i]].second;
-    pivot = ctx.mergelist.length();
-    loopj(n) {
-      const auto tri = ctx.vidx[first+j];
-      const auto i0 = pm.idx[3*tri], i1 = pm.idx[3*tri+1], i2 = pm.idx[3*tri+2];
-      if (int(i0) == other[i] || int(i1) == other[i] || int(i2) == other[i])
-        continue;
-      ctx.mergelist.add(tri);
-    }
+  // the collapse only modifies triangles around the removed vertex
+  const auto from = edge.best == 0 ? idx1 : idx0;
+  const auto to = edge.best == 0 ? idx0 : idx1;
+  const auto &p = pm.pos;
+  auto &corner = ctx.corner;
+  auto &ring = ctx.ring;
+  assert(ctx.vcorner[from] != -1 && ctx.vcorner[to] != -1);
+  ring.setsize(0);
+  for (auto c = ctx.vcorner[from];;) {
+    ring.add(c);
+    if ((c = corner[c].next) == ctx.vcorner[from]) break;
   }
 
   // now we need to know if this is going to flip normals. if so, the merge is
   // invalid
-  const auto from = edge.best == 0 ? idx1 : idx0;
-  const auto to = edge.best == 0 ? idx0 : idx1;
-  const auto begin = edge.best == 0 ? pivot : 0;
-  const auto end = edge.best == 0 ? ctx.mergelist.length() : pivot;
-  rangei(begin,end) {
-    const auto &p = pm.pos;
-    const auto t = &pm.idx[3*ctx.mergelist[i]];
-    auto i0 = int(t[0]), i1 = int(t[1]), i2 = int(t[2]);
-    const vec3f initial(cross(p[i0]-p[i1],p[i0]-p[i2]));
-    i0 = i0 == from ? to : i0;
-    i1 = i1 == from ? to : i1;
-    i2 = i2 == from ? to : i2;
-    if (isdegenerated(i0,i1,i2)) continue;
-    const vec3f target(cross(p[i0]-p[i1],p[i0]-p[i2]));
+  loopv(ring) {
+    const auto next = corner[nextcorner(ring[i])].vert;
+    const auto prev = corner[prevcorner(ring[i])].vert;
+    if (next == to || prev == to) continue;
+    const vec3f initial(cross(p[from]-p[next],p[from]-p[prev]));
+    const vec3f target(cross(p[to]-p[next],p[to]-p[prev]));
     if (dot(initial,target) <= 0.f)
       return false;
   }
 
-  // we are good to go. we replace each 'from' by 'to' in the index buffer
-  loopi(2) {
-    const auto first = ctx.vtri[idx[i]].first;
-    const auto n = ctx.vtri[idx[i]].second;
-    loopj(n) {
-      const auto tri = ctx.vidx[first+j];
-      const auto t = &pm.idx[3*tri];
-      loopk(3) if (int(t[k]) == from) t[k] = to;
+  // link condition: a vertex adjacent to both ends must be opposite to the
+  // collapsed edge. otherwise, we would create a non-manifold fold
+  auto &vmark = ctx.vmark;
+  const auto mark = ctx.mark += 2;
+  for (auto c = ctx.vcorner[to];;) {
+    vmark[corner[nextcorner(c)].vert] = vmark[corner[prevcorner(c)].vert] = mark;
+    if ((c = corner[c].next) == ctx.vcorner[to]) break;
+  }
+  loopv(ring) {
+    const auto next = corner[nextcorner(ring[i])].vert;
+    const auto prev = corner[prevcorner(ring[i])].vert;
+    if (next == to) vmark[prev] = mark+1;
+    if (prev == to) vmark[next] = mark+1;
+  }
+  loopv(ring) {
+    const auto next = corner[nextcorner(ring[i])].vert;
+    const auto prev = corner[prevcorner(ring[i])].vert;
+    if (vmark[next] == mark || vmark[prev] == mark) return false;
+  }
+
+  // we are good to go. triangles using both vertices disappear. edge (from,x)
+  // is replaced by edge (to,x) and edge (from,to) is removed. edges count their
+  // live triangles such that an edge with no triangle left is removed too
+  auto &remap = ctx.remap;
+  auto &killed = ctx.killed;
+  auto &eqem = ctx.eqem;
+  remap.setsize(0);
+  killed.setsize(0);
+  loopv(ring) {
+    const auto c = ring[i];
+    const auto next = nextcorner(c), prev = prevcorner(c);
+    const auto cto = corner[next].vert == to ? next : prev;
+    if (corner[cto].vert != to || corner[c].next == -1) continue;
+    const auto cx = cto == next ? prev : next;
+    const auto fromx = corner[cto].edge, tox = corner[c].edge;
+    bool found = fromx == tox;
+    loopj(remap.length()) found = found || remap[j].first == fromx;
+    if (!found) remap.add(makepair(fromx, tox));
+    loopj(3) {
+      const auto e = corner[3*(c/3)+j].edge;
+      --eqem[e].num;
+      killed.add(e);
+    }
+    eqem[corner[cx].edge].idx[0] = eqem[corner[cx].edge].idx[1] = to;
+    unlinkcorner(ctx, c);
+    unlinkcorner(ctx, cto);
+    unlinkcorner(ctx, cx);
+    corner[c].vert = to;
+  }
+  loopv(remap) {
+    auto &fromx = eqem[remap[i].first], &tox = eqem[remap[i].second];
+    tox.num += fromx.num;
+    fromx.idx[0] = fromx.idx[1] = to;
+
+    // the heap entry of the removed edge is lost. the other one is stale
+    // anyway and will be updated when popped
+    if (fromx.queued && !tox.queued) {
+      tox.queued = 1;
+      ctx.heap.addheap({0.0, 0.f, remap[i].second});
     }
   }
+  loopv(killed) {
+    auto &e = eqem[killed[i]];
+    if (e.num == 0) e.idx[0] = e.idx[1] = to;
+  }
 
-  // we now commit the merged triangle list. we try to see if we can reuse one
-  // of both lists. if not, we just linear allocate a new range
-  // XXX we should remove degenerated triangles as well
-  int first = -1;
-  loopi(2) if (ctx.vtri[idx[i]].second >= ctx.mergelist.length()) {
-    first = ctx.vtri[idx[i]].first;
-    break;
+  // remaining corners are moved to the ring of 'to'
+  loopv(ring) {
+    const auto c = ring[i];
+    if (corner[c].next == -1) continue;
+    const int e[] = {nextcorner(c), prevcorner(c)};
+    loopj(2) {
+      auto &edge = corner[e[j]].edge;
+      loopk(remap.length()) if (remap[k].first == edge) edge = remap[k].second;
+      loopk(2) if (eqem[edge].idx[k] == from) eqem[edge].idx[k] = to;
+    }
+    corner[c].vert = to;
   }
-  if (first == -1) {
-    first = ctx.vidx.length();
-    ctx.vidx.setsize(first+ctx.mergelist.length());
+  const auto first = ctx.vcorner[from];
+  if (first != -1) {
+    auto &tofirst = ctx.vcorner[to];
+    if (tofirst == -1)
+      tofirst = first;
+    else {
+      const auto next = corner[first].next, tonext = corner[tofirst].next;
+      corner[first].next = tonext;
+      corner[tonext].prev = first;
+      corner[tofirst].next = next;
+      corner[next].prev = tofirst;
+    }
+    ctx.vcorner[from] = -1;
   }
-  loopv(ctx.mergelist) ctx.vidx[first+i] = ctx.mergelist[i];
-  ctx.vtri[to].first = first;
-  ctx.vtri[to].second = ctx.mergelist.length();
 
   // add both qems
   auto &q0 = ctx.vqem[idx0], &q1 = ctx.vqem[idx1];
@@ -364,13 +566,10 @@ static bool merge(qemcontext &ctx, procmesh &pm, const qemedge &edge, int idx0,
   const auto q = q0+q1;
   const auto newstamp = max(timestamp0, timestamp1);
   assert(timestamp0==edge.timestamp[0] && timestamp1==edge.timestamp[1]);
-  if (edge.best == 0) {
+  if (edge.best == 0)
     q0 = q;
-    q1.next = idx0;
-  } else {
+  else
     q1 = q;
-    q0.next = idx1;
-  }
   q0.timestamp = q1.timestamp = newstamp+1;
   return true;
 }
@@ -387,8 +586,7 @@ static void decimatemesh(qemcontext &ctx, procmesh &pm, float edgeminlen) {
     anychange = false;
     loopv(eqem) {
       auto &edge = eqem[i];
-      const auto idx0 = uncollapsedidx(vqem, edge.idx[0]);
-      const auto idx1 = uncollapsedidx(vqem, edge.idx[1]);
+      const auto idx0 = edge.idx[0], idx1 = edge.idx[1];
       const auto &p0 = pm.pos[idx0];
       const auto &p1 = pm.pos[idx1];
 
@@ -408,13 +606,13 @@ static void decimatemesh(qemcontext &ctx, procmesh &pm, float edgeminlen) {
     }
   }
 
-  // we remove zero cost edges
-  for (;;) {
+  // we remove zero cost edges. small chunks may run out of edges
+  while (heap.length() != 0) {
     const auto item = heap.removeheap();
-    if (item.len2 > MAX_EDGE_LEN*MAX_EDGE_LEN) continue;
     auto &edge = eqem[item.idx];
-    const auto idx0 = uncollapsedidx(vqem, edge.idx[0]);
-    const auto idx1 = uncollapsedidx(vqem, edge.idx[1]);
+    edge.queued = 0;
+    if (item.len2 > ctx.maxedgelen*ctx.maxedgelen) continue;
+    const auto idx0 = edge.idx[0], idx1 = edge.idx[1];
 
     // already removed. we ignore it
     if (idx0 == idx1) continue;
@@ -428,7 +626,8 @@ static void decimatemesh(qemcontext &ctx, procmesh &pm, float edgeminlen) {
     // edge is upto date. we can safely remove it
     const auto timestamp0 = q0.timestamp, timestamp1 = q1.timestamp;
     if (timestamp0 == edge.timestamp[0] && timestamp1 == edge.timestamp[1]) {
-      if (item.cost > QEM_MIN_ERROR) break;
+      if (item.cost > ctx.maxerror) break;
+
       merge(ctx, pm, edge, idx0, idx1);
       continue;
     }
@@ -439,8 +638,7 @@ static void decimatemesh(qemcontext &ctx, procmesh &pm, float edgeminlen) {
     edge.best = best.second;
     edge.timestamp[0] = timestamp0;
     edge.timestamp[1] = timestamp1;
-    edge.idx[0] = idx0;
-    edge.idx[1] = idx1;
+    edge.queued = 1;
     heap.addheap(newitem);
   }
 
@@ -449,9 +647,10 @@ static void decimatemesh(qemcontext &ctx, procmesh &pm, float edgeminlen) {
   loopv(mapping) mapping[i] = -1;
   vector<u32> newidx, newmat;
   const auto trinum = pm.trinum();
+  const auto &corner = ctx.corner;
   auto vertnum = 0;
   loopi(trinum) {
-    const u32 idx[] = {pm.idx[3*i+0], pm.idx[3*i+1], pm.idx[3*i+2]};
+    const int idx[] = {corner[3*i].vert, corner[3*i+1].vert, corner[3*i+2].vert};
     if (idx[0] == idx[1] || idx[1] == idx[2] || idx[2] == idx[0])
       continue;
     newmat.add(pm.mat[i]);
@@ -463,10 +662,18 @@ static void decimatemesh(qemcontext &ctx, procmesh &pm, float edgeminlen) {
   newidx.moveto(pm.idx);
   newmat.moveto(pm.mat);
 
+  // locked vertices are kept even if no triangle uses them anymore
+  loopv(mapping) if (mapping[i] == -1 && pm.locked(i)) mapping[i] = vertnum++;
+
   // compact vertex buffer
   vector<vec3f> newpos(vertnum);
-  loopv(mapping) if (mapping[i] != -1) newpos[mapping[i]] = pm.pos[i];
+  vector<int> newkey(vertnum);
+  loopv(mapping) if (mapping[i] != -1) {
+    newpos[mapping[i]] = pm.pos[i];
+    newkey[mapping[i]] = pm.key[i];
+  }
   newpos.moveto(pm.pos);
+  newkey.moveto(pm.key);
 }
 
 static void buildqem(qemcontext &ctx, procmesh &pm) {
@@ -486,37 +693,54 @@ static void buildqem(qemcontext &ctx, procmesh &pm) {
   }
 }
 
-static void buildtrianglelists(qemcontext &ctx, const procmesh &pm) {
-  auto &vtri = ctx.vtri;
-  auto &vidx = ctx.vidx;
-  vtri.setsize(pm.pos.length());
-  vidx.setsize(pm.idx.length());
-
-  // first initialize tri lists
-  loopv(vtri) vtri[i].first = vtri[i].second = 0;
-  loopv(pm.idx) ++vtri[pm.idx[i]].second;
-  auto accum = 0;
-  loopv(vtri) {
-    vtri[i].first = accum;
-    accum += vtri[i].second;
-    vtri[i].second = 0;
-  }
-  assert(accum == pm.idx.length());
+static void buildcorners(qemcontext &ctx, const procmesh &pm) {
+  auto &c = ctx.corner;
+  auto &v = ctx.vcorner;
+  c.setsize(pm.idx.length());
+  v.setsize(pm.pos.length());
+  ctx.vmark.setsize(pm.pos.length());
+  ctx.mark = 0;
+  loopv(v) v[i] = -1;
+  loopv(ctx.vmark) ctx.vmark[i] = 0;
 
-  // then, fill them
+  // link each corner in the ring of its vertex
   loopv(pm.idx) {
-    auto &v = vtri[pm.idx[i]];
-    vidx[v.first+v.second++] = i/3;
+    auto &first = v[pm.idx[i]];
+    c[i].vert = pm.idx[i];
+    c[i].edge = -1;
+    if (first == -1) {
+      c[i].next = c[i].prev = first = i;
+      continue;
+    }
+    const auto next = c[first].next;
+    c[i].next = next;
+    c[i].prev = first;
+    c[next].prev = i;
+    c[first].next = i;
   }
 }
 
-static void decimatemesh(procmesh &pm, float cellsize) {
+static void decimatepass(procmesh &pm, float cellsize, u32 lod) {
   if (pm.idx.length() == 0) return;
   qemcontext ctx;
+  if (lod == 0) {
+    ctx.maxerror = QEM_MIN_ERROR;
+    ctx.maxedgelen = MAX_EDGE_LEN;
+  } else {
+    // qems are weighted by triangle areas. we weight the error with the area
+    // of one cell
+    const auto lodsize = double(cellsize*float(1<<(lod-1)));
+    const auto dist = double(LOD_ERROR_FACTOR)*lodsize;
+    ctx.maxerror = max(dist*dist*lodsize*lodsize, QEM_MIN_ERROR);
+    ctx.maxedgelen = MAX_EDGE_LEN*float(1<<lod);
+  }
 
   // we go over all triangles and build all vertex qem
   buildqem(ctx, pm);
 
+  // build the corner table used to walk around the vertices
+  buildcorners(ctx, pm);
+
   // build the list of edges. append extra planes when needed (border and
   // multi-material edges)
   buildedges(ctx, pm);
@@ -524,19 +748,157 @@ static void decimatemesh(procmesh &pm, float cellsize) {
   // evaluate the cost for each edge and build the heap
   buildheap(ctx, pm);
 
-  // generate the lists of triangles per-vertex
-  buildtrianglelists(ctx, pm);
-
   // decimate the mesh using quadric error functions
-  const auto minlen = cellsize*MIN_EDGE_FACTOR;
+  const auto minlen = lod == 0 ? cellsize*MIN_EDGE_FACTOR :
+                                 cellsize*LOD_EDGE_FACTOR*float(1<<(lod-1));
   decimatemesh(ctx, pm, minlen);
 }
 
+/*-------------------------------------------------------------------------
+ - big meshes are cut into spatial clusters decimated in parallel. vertices
+ - on the cuts are locked such that clusters are independent. a last pass
+ - over the whole mesh then decimates around the cuts
+ -------------------------------------------------------------------------*/
+static const int CLUSTER_MIN_TRI = 16384; // below, we decimate in one pass
+static const int CLUSTER_DIM = 2;         // clusters per axis
+static const int CLUSTER_NUM = CLUSTER_DIM*CLUSTER_DIM*CLUSTER_DIM;
+static const int SHARED_VERTEX = -2;
+
+struct clustertask : public task {
+  INLINE clustertask(procmesh &pm, float cellsize, u32 lod) :
+    task("clustertask", CLUSTER_NUM), pm(pm), cellsize(cellsize), lod(lod)
+  {}
+
+  // the cluster of a triangle is given by its center
+  void partition() {
+    aabb box(FLT_MAX, -FLT_MAX);
+    loopv(pm.pos) {
+      box.pmin = min(box.pmin, pm.pos[i]);
+      box.pmax = max(box.pmax, pm.pos[i]);
+    }
+    const auto scale = float(CLUSTER_DIM) / max(box.pmax-box.pmin, vec3f(FLT_MIN));
+    const auto trinum = pm.trinum();
+    cluster.setsize(trinum);
+    owner.setsize(pm.pos.length());
+    loopv(owner) owner[i] = -1;
+    loopi(trinum) {
+      const auto t = &pm.idx[3*i];
+      const auto center = (pm.pos[t[0]]+pm.pos[t[1]]+pm.pos[t[2]]) / 3.f;
+      const auto xyz = clamp(vec3i((center-box.pmin)*scale), vec3i(zero), vec3i(CLUSTER_DIM-1));
+      cluster[i] = xyz.x+CLUSTER_DIM*(xyz.y+CLUSTER_DIM*xyz.z);
+      loopj(3) {
+        auto &o = owner[t[j]];
+        o = o == -1 || o == cluster[i] ? cluster[i] : SHARED_VERTEX;
+      }
+    }
+  }
+
+  // locked vertices keep their index in the whole mesh as key
+  virtual void run(u32 c) {
+    const iso::stagetimer timer(iso::STAGE_DECIMATE);
+    auto &m = sub[c];
+    vector<int> mapping(pm.pos.length());
+    loopv(mapping) mapping[i] = -1;
+    loopi(pm.trinum()) {
+      if (cluster[i] != int(c)) continue;
+      m.mat.add(pm.mat[i]);
+      loopj(3) {
+        const auto v = pm.idx[3*i+j];
+        if (mapping[v] == -1) {
+          mapping[v] = m.pos.length();
+          m.pos.add(pm.pos[v]);
+          m.key.add(pm.locked(v) || owner[v] == SHARED_VERTEX ? int(v) : -1);
+        }
+        m.idx.add(mapping[v]);
+      }
+    }
+    loopi(DECIMATION_NUM) decimatepass(m, cellsize, lod);
+  }
+
+  procmesh &pm;
+  vector<int> cluster, owner;
+  float cellsize;
+  u32 lod;
+  procmesh sub[CLUSTER_NUM];
+};
+
+// gather the decimated clusters and decimate around the cuts
+struct boundarytask : public task {
+  INLINE boundarytask(clustertask &clusters) :
+    task("boundarytask"), clusters(&clusters)
+  {}
+  virtual void run(u32) {
+    const iso::stagetimer timer(iso::STAGE_DECIMATE);
+    auto &pm = clusters->pm;
+    procmesh merged;
+    vector<int> mapping(pm.pos.length());
+    loopv(mapping) mapping[i] = -1;
+    loopi(CLUSTER_NUM) {
+      const auto &sub = clusters->sub[i];
+      vector<u32> local(sub.pos.length());
+      loopvj(sub.pos) {
+        const auto v = sub.key[j];
+        if (v == -1) {
+          local[j] = merged.pos.length();
+          merged.pos.add(sub.pos[j]);
+          merged.key.add(-1);
+          continue;
+        }
+        if (mapping[v] == -1) {
+          mapping[v] = merged.pos.length();
+          merged.pos.add(pm.pos[v]);
+          merged.key.add(pm.key[v]);
+        }
+        local[j] = mapping[v];
+      }
+      loopvj(sub.idx) merged.idx.add(local[sub.idx[j]]);
+      loopvj(sub.mat) merged.mat.add(sub.mat[j]);
+    }
+
+    // locked vertices that no triangle uses are kept as well
+    loopv(pm.key) if (pm.locked(i) && mapping[i] == -1) {
+      merged.pos.add(pm.pos[i]);
+      merged.key.add(pm.key[i]);
+    }
+    merged.pos.moveto(pm.pos);
+    merged.idx.moveto(pm.idx);
+    merged.mat.moveto(pm.mat);
+    merged.key.moveto(pm.key);
+    decimatepass(pm, clusters->cellsize, clusters->lod);
+  }
+  ref<clustertask> clusters;
+};
+
+// small meshes are decimated right away. otherwise, the cluster and boundary
+// tasks end this one
+struct decimatetask : public task {
+  INLINE decimatetask(procmesh &pm, float cellsize, u32 lod) :
+    task("decimatetask"), pm(pm), cellsize(cellsize), lod(lod)
+  {}
+  virtual void run(u32) {
+    if (pm.trinum() < CLUSTER_MIN_TRI) {
+      const iso::stagetimer timer(iso::STAGE_DECIMATE);
+      loopi(DECIMATION_NUM) decimatepass(pm, cellsize, lod);
+      return;
+    }
+    const auto clusters = NEW(clustertask, pm, cellsize, lod);
+    clusters->partition();
+    ref<task> boundary = NEW(boundarytask, *clusters);
+    clusters->starts(*boundary);
+    boundary->ends(*this);
+    boundary->scheduled();
+    clusters->scheduled();
+  }
+  procmesh &pm;
+  float cellsize;
+  u32 lod;
+};
+
 /*-------------------------------------------------------------------------
  - sharpen mesh i.e. duplicate sharp points and compute vertex normals
  -------------------------------------------------------------------------*/
 static void sharpenmesh(procmesh &pm) {
-  if (pm.idx.length() == 0) return;
+  const iso::stagetimer timer(iso::STAGE_SHARPEN);
   const auto trinum = pm.trinum();
   vector<int> vertlist(pm.pos.length());
   vector<vec3f> newnor(pm.pos.length());
@@ -582,6 +944,7 @@ static void sharpenmesh(procmesh &pm) {
           vertlist[t[j]] = newnor.length();
           vertlist.add(old);
           pm.pos.add(pm.pos[t[j]]);
+          pm.key.add(-1);
           newnor.add(dir);
         }
       }
@@ -601,106 +964,532 @@ static void sharpenmesh(procmesh &pm) {
 }
 
 /*-------------------------------------------------------------------------
- - build a final mesh from the qef points and quads stored in the octree
+ - reorder the triangles of every material for the post-transform vertex cache
+ - (forsyth's linear-speed optimization) and the vertices by first use
  -------------------------------------------------------------------------*/
-
-// build a first mesh from contoured octree
-struct isomeshtask : public task {
-  INLINE isomeshtask(iso::octree &o, procmesh &pm) :
-    task("isomeshtask"), o(o), pm(pm)
-  {}
-  virtual void run(u32) {
-    buildmesh(o, o.m_root, pm);
-    con::out("iso: procmesh: %d vertices", pm.pos.length());
-    con::out("iso: procmesh: %d triangles", pm.idx.length()/3);
+static const int VCACHE_SIZE = 32;
+static const int VCACHE_MAX_VALENCE = 64; // beyond, valence score is tabulated
+static const float VCACHE_DECAY = 1.5f;
+static const float VCACHE_LAST_TRI = 0.75f;
+static const float VCACHE_VALENCE_SCALE = 2.f;
+static const float VCACHE_VALENCE_POWER = 0.5f;
+
+struct vcachetable {
+  vcachetable() {
+    loopi(3) cache[i] = VCACHE_LAST_TRI;
+    rangei(3, VCACHE_SIZE) {
+      const auto scaler = 1.f/float(VCACHE_SIZE-3);
+      cache[i] = powf(1.f-float(i-3)*scaler, VCACHE_DECAY);
+    }
+    valence[0] = 0.f;
+    rangei(1, VCACHE_MAX_VALENCE)
+      valence[i] = VCACHE_VALENCE_SCALE*powf(float(i), -VCACHE_VALENCE_POWER);
   }
-  iso::octree &o;
-  procmesh &pm;
+  INLINE float score(int cachepos, int remaining) const {
+    if (remaining == 0) return -1.f;
+    const auto v = valence[min(remaining, VCACHE_MAX_VALENCE-1)];
+    return cachepos < 0 ? v : v + cache[cachepos];
+  }
+  float cache[VCACHE_SIZE];
+  float valence[VCACHE_MAX_VALENCE];
 };
 
-// decimate a procmesh using qem
-struct decimatetask : public task {
-  INLINE decimatetask(procmesh &pm, float cellsize) :
-    task("decimatetask"), pm(pm), cellsize(cellsize)
-  {}
-  virtual void run(u32) { decimatemesh(pm, cellsize); }
-  procmesh &pm;
-  float cellsize;
+// misses of a fifo cache with VCACHE_SIZE entries
+static u32 vcachemisses(const vector<u32> &idx, int vertnum) {
+  vector<int> stamp(vertnum);
+  loopv(stamp) stamp[i] = -VCACHE_SIZE-1;
+  int misses = 0;
+  loopv(idx) if (misses - stamp[idx[i]] > VCACHE_SIZE) stamp[idx[i]] = misses++;
+  return misses;
+}
+
+struct vcachecontext {
+  vcachecontext(const procmesh &pm) :
+    pm(pm), vfirst(pm.pos.length()), vtri(pm.idx.length()),
+    remaining(pm.pos.length()), cachepos(pm.pos.length()),
+    vscore(pm.pos.length()), tscore(pm.trinum()), emitted(pm.trinum())
+  {
+    loopv(remaining) remaining[i] = 0;
+    loopv(cachepos) cachepos[i] = -1;
+    loopv(emitted) emitted[i] = false;
+  }
+
+  // greedily emit the triangles of [first,last) with the best score
+  void reorder(int first, int last, vector<int> &order) {
+    // build the lists of triangles per vertex. emitted triangles are removed
+    // from them such that only remaining triangles are visited
+    verts.setsize(0);
+    rangei(first, last) {
+      const auto t = &pm.idx[3*i];
+      loopj(3) if (remaining[t[j]]++ == 0) verts.add(t[j]);
+    }
+    auto offset = 0;
+    loopv(verts) {
+      const auto v = verts[i];
+      vfirst[v] = offset;
+      offset += remaining[v];
+      vscore[v] = table.score(-1, remaining[v]);
+      remaining[v] = 0;
+    }
+    rangei(first, last) {
+      const auto t = &pm.idx[3*i];
+      loopj(3) vtri[vfirst[t[j]] + remaining[t[j]]++] = i;
+      tscore[i] = vscore[t[0]] + vscore[t[1]] + vscore[t[2]];
+    }
+
+    int cache[VCACHE_SIZE+3], cachenum = 0, scan = first, best = -1;
+    loopi(last-first) {
+      // cache is exhausted. take the next triangle in the initial order
+      if (best == -1) {
+        while (emitted[scan]) ++scan;
+        best = scan;
+      }
+      order.add(best);
+      emitted[best] = true;
+
+      // emitted vertices go in front of the cache
+      int newcache[VCACHE_SIZE+3], newnum = 0;
+      const auto t = &pm.idx[3*best];
+      loopj(3) {
+        const auto v = t[j];
+        const auto list = &vtri[vfirst[v]];
+        const auto n = --remaining[v];
+        loopk(n) if (list[k] == best) {
+          list[k] = list[n];
+          break;
+        }
+        newcache[newnum++] = v;
+      }
+      loopj(cachenum)
+        if (int(t[0]) != cache[j] && int(t[1]) != cache[j] && int(t[2]) != cache[j])
+          newcache[newnum++] = cache[j];
+
+      // update the scores of the vertices in the cache or just evicted
+      loopj(newnum) {
+        const auto v = newcache[j];
+        cachepos[v] = j < VCACHE_SIZE ? j : -1;
+        const auto score = table.score(cachepos[v], remaining[v]);
+        const auto delta = score - vscore[v];
+        const auto list = &vtri[vfirst[v]];
+        vscore[v] = score;
+        loopk(remaining[v]) tscore[list[k]] += delta;
+      }
+      cachenum = min(newnum, VCACHE_SIZE);
+      loopj(cachenum) cache[j] = newcache[j];
+
+      // the next triangle is the best one using a vertex in the cache
+      best = -1;
+      auto bestscore = -1.f;
+      loopj(cachenum) {
+        const auto v = cache[j];
+        const auto list = &vtri[vfirst[v]];
+        loopk(remaining[v]) if (tscore[list[k]] > bestscore) {
+          best = list[k];
+          bestscore = tscore[list[k]];
+        }
+      }
+    }
+    loopi(cachenum) cachepos[cache[i]] = -1;
+  }
+
+  const procmesh &pm;
+  const vcachetable table;
+  vector<int> verts, vfirst, vtri, remaining, cachepos;
+  vector<float> vscore, tscore;
+  vector<bool> emitted;
 };
 
-// create proper (possible sharpened) normals and finish the mesh
-struct finishtask : public task {
-  INLINE finishtask(mesh &m, procmesh &pm) :
-    task("finishtask"), m(m), pm(pm)
+static void optimizemesh(procmesh &pm) {
+  const iso::stagetimer timer(iso::STAGE_VCACHE);
+  const auto trinum = pm.trinum(), vertnum = pm.pos.length();
+  if (trinum == 0) return;
+  const auto missin = vcachemisses(pm.idx, vertnum);
+
+  // group the triangles by material such that every material is one segment
+  vector<pair<u32,int>> bymat(trinum);
+  loopi(trinum) bymat[i] = makepair(pm.mat[i], i);
+  quicksort(bymat.begin(), bymat.end(), [](const pair<u32,int> &t0, const pair<u32,int> &t1) {
+    return t0.first != t1.first ? t0.first < t1.first : t0.second < t1.second;
+  });
+  vector<u32> grouped(3*trinum), newmat(trinum);
+  loopi(trinum) {
+    loopj(3) grouped[3*i+j] = pm.idx[3*bymat[i].second+j];
+    newmat[i] = bymat[i].first;
+  }
+  grouped.moveto(pm.idx);
+
+  // run the optimizer on each group
+  vector<int> order;
+  {
+    vcachecontext ctx(pm);
+    for (int first = 0, last = 0; first < trinum; first = last) {
+      while (last < trinum && newmat[last] == newmat[first]) ++last;
+      ctx.reorder(first, last, order);
+    }
+  }
+
+  // renumber vertices by first use. unused (locked) vertices go last
+  vector<int> mapping(vertnum);
+  loopv(mapping) mapping[i] = -1;
+  vector<u32> newidx(3*trinum);
+  auto next = 0;
+  loopv(order) loopj(3) {
+    const auto v = pm.idx[3*order[i]+j];
+    if (mapping[v] == -1) mapping[v] = next++;
+    newidx[3*i+j] = mapping[v];
+  }
+  loopv(mapping) if (mapping[i] == -1) mapping[i] = next++;
+  vector<vec3f> newpos(vertnum), newnor(vertnum);
+  vector<int> newkey(vertnum);
+  loopv(mapping) {
+    newpos[mapping[i]] = pm.pos[i];
+    newnor[mapping[i]] = pm.nor[i];
+    newkey[mapping[i]] = pm.key[i];
+  }
+  newidx.moveto(pm.idx);
+  newmat.moveto(pm.mat);
+  newpos.moveto(pm.pos);
+  newnor.moveto(pm.nor);
+  newkey.moveto(pm.key);
+  iso::recordvcache(trinum, missin, vcachemisses(pm.idx, vertnum));
+}
+
+/*-------------------------------------------------------------------------
+ - build a final mesh from the qef points and quads stored in the octree
+ -------------------------------------------------------------------------*/
+static void buildsegments(vector<segment> &seg, const vector<u32> &mat, u32 first) {
+  u32 currmat = ~0x0;
+  loopv(mat) {
+    if (mat[i] != currmat) {
+      seg.add({first+3u*i,0u,mat[i]});
+      currmat = mat[i];
+    }
+    seg.last().num += 3;
+  }
+}
+
+// vertices with no normal yet get it from the seam triangles
+static void seamnormals(const vector<vec3f> &pos, vector<vec3f> &nor,
+                        const vector<u32> &idx, int first)
+{
+  vector<bool> missing(nor.length());
+  loopv(nor) missing[i] = length2(nor[i]) == 0.f;
+  for (int i = first; i < idx.length(); i += 3) {
+    const auto t = &idx[i];
+    const auto n = cross(pos[t[2]]-pos[t[0]], pos[t[2]]-pos[t[1]]);
+    loopj(3) if (missing[t[j]]) nor[t[j]] += n;
+  }
+  loopv(nor) if (missing[i]) {
+    const auto len2 = length2(nor[i]);
+    if (len2 != 0.f) nor[i] = nor[i]*rsqrt(len2);
+  }
+}
+
+static void initmesh(mesh &m, vector<vec3f> &pos, vector<vec3f> &nor,
+                     vector<u32> &idx, vector<segment> &seg)
+{
+#if !defined(NDEBUG)
+  loopv(pos) assert(!isnan(pos[i].x)&&!isnan(pos[i].y)&&!isnan(pos[i].z));
+  loopv(pos) assert(!isinf(pos[i].x)&&!isinf(pos[i].y)&&!isinf(pos[i].z));
+  loopv(nor) assert(!isnan(nor[i].x)&&!isnan(nor[i].y)&&!isnan(nor[i].z));
+  loopv(nor) assert(!isinf(nor[i].x)&&!isinf(nor[i].y)&&!isinf(nor[i].z));
+#endif /* !defined(NDEBUG) */
+  const auto p = pos.move();
+  const auto n = nor.move();
+  const auto index = idx.move();
+  const auto s = seg.move();
+  m.init(p.first, n.first, index.first, s.first, p.second, index.second, s.second);
+}
+
+static void copymesh(procmesh &dst, const procmesh &src) {
+  dst.pos.setsize(0);
+  dst.idx.setsize(0);
+  dst.mat.setsize(0);
+  dst.key.setsize(0);
+  loopv(src.pos) dst.pos.add(src.pos[i]);
+  loopv(src.idx) dst.idx.add(src.idx[i]);
+  loopv(src.mat) dst.mat.add(src.mat[i]);
+  loopv(src.key) dst.key.add(src.key[i]);
+}
+
+// finish the mesh of one level of details once it is decimated and start the
+// decimation of the next level
+struct lodtask : public task {
+  INLINE lodtask(meshbuilder &mb, meshchunk &c, u32 lod) :
+    task("lodtask"), mb(mb), c(c), lod(lod)
   {}
   virtual void run(u32) {
-    // handle sharp edges and create normals
+    if (lod == 0)
+      finish();
+    else {
+      // locked points never move. seams then fit every level of details
+      procmesh sharp;
+      copymesh(sharp, c.lod);
+      sharpenmesh(sharp);
+      optimizemesh(sharp);
+      SDL_LockMutex(mb.mutex);
+        output(mb, sharp, lod);
+      SDL_UnlockMutex(mb.mutex);
+    }
+    if (mb.sink == NULL || lod+1 >= mb.lodnum) {
+      c.lod.destroy();
+      return;
+    }
+    ref<task> decimate = NEW(decimatetask, c.lod, mb.cellsize, lod+1);
+    ref<task> next = NEW(lodtask, mb, c, lod+1);
+    decimate->starts(*next);
+    next->ends(*this);
+    next->scheduled();
+    decimate->scheduled();
+  }
+
+  void finish() {
+    // without sink, the stitched mesh is decimated again around the seams and
+    // finished at once. seams need the index of the locked points
+    auto &pm = c.pm;
+    if (mb.sink == NULL) {
+      loopv(pm.key) if (pm.key[i] != -1) c.locked[pm.key[i]]->idx = i;
+      return;
+    }
+
+    // coarser levels of details start from the mesh before sharpening
+    if (mb.lodnum > 1) copymesh(c.lod, pm);
     sharpenmesh(pm);
+    optimizemesh(pm);
 
-    // build the segment list
+    // seams now need the final index of the locked points
+    loopv(pm.key) if (pm.key[i] != -1) c.locked[pm.key[i]]->idx = i;
+    emit();
+  }
+
+  static void output(meshbuilder &mb, procmesh &pm, u32 lod) {
+    if (pm.idx.length() == 0) return;
     vector<segment> seg;
-    u32 currmat = ~0x0;
-    loopv(pm.mat) {
-      if (pm.mat[i] != currmat) {
-        seg.add({3u*i,0u,pm.mat[i]});
-        currmat = pm.mat[i];
+    buildsegments(seg, pm.mat, 0);
+    mesh m;
+    initmesh(m, pm.pos, pm.nor, pm.idx, seg);
+    mb.sink(m, lod, mb.udata);
+    m.destroy();
+  }
+
+  // give the chunk to the sink and release everything but its seams. the
+  // border cells are recorded so the leaves of the chunk can go
+  void emit() {
+    auto &pm = c.pm;
+    SDL_LockMutex(mb.mutex);
+      loopv(c.bordercells) {
+        const auto qef = c.bordercells[i].second;
+        if (qef->chunk != SEAMPOINT) {
+          const auto used = qef->chunk == c.id;
+          mb.seampos.add(used ? pm.pos[qef->idx] : qef->pos);
+          mb.seamnor.add(used ? pm.nor[qef->idx] : vec3f(zero));
+          qef->idx = mb.seampos.length()-1;
+          qef->chunk = SEAMPOINT;
+        }
+        mb.border.insert(makepair(cellkey(c.bordercells[i].first), u32(qef->idx)));
       }
-      seg.last().num += 3;
-    }
+      output(mb, pm, 0);
+    SDL_UnlockMutex(mb.mutex);
+    mb.o.freeleaves(c.root);
+    c.bordercells.destroy();
+    c.locked.destroy();
+    pm.destroy();
+  }
 
-#if !defined(NDEBUG)
-    loopv(pm.pos) assert(!isnan(pm.pos[i].x)&&!isnan(pm.pos[i].y)&&!isnan(pm.pos[i].z));
-    loopv(pm.pos) assert(!isinf(pm.pos[i].x)&&!isinf(pm.pos[i].y)&&!isinf(pm.pos[i].z));
-    loopv(pm.nor) assert(!isnan(pm.nor[i].x)&&!isnan(pm.nor[i].y)&&!isnan(pm.nor[i].z));
-    loopv(pm.nor) assert(!isinf(pm.nor[i].x)&&!isinf(pm.nor[i].y)&&!isinf(pm.nor[i].z));
-#endif /* !defined(NDEBUG) */
+  meshbuilder &mb;
+  meshchunk &c;
+  u32 lod;
+};
 
-    const auto p = pm.pos.move();
-    const auto n = pm.nor.move();
-    const auto idx = pm.idx.move();
-    const auto s = seg.move();
-    con::out("iso: final: %d vertices", p.second);
-    con::out("iso: final: %d triangles", idx.second/3);
-    m.init(p.first, n.first, idx.first, s.first, p.second, idx.second, s.second);
+// build the mesh of one chunk. decimation and levels of details follow as
+// tasks that end this one
+struct chunktask : public task {
+  INLINE chunktask(meshbuilder &mb, iso::octree::node &root) :
+    task("chunktask"), mb(mb), root(root)
+  {}
+  virtual void run(u32) {
+    const iso::stagetimer timer(iso::STAGE_CHUNK);
+    SDL_LockMutex(mb.mutex);
+      const auto c = NEW(meshchunk, root, mb.o.m_dim, mb.chunks.length());
+      mb.chunks.add(c);
+    SDL_UnlockMutex(mb.mutex);
+    {
+      const iso::stagetimer timer(iso::STAGE_BUILDMESH);
+      markborder(root, *c, mb.sink != NULL);
+      buildmesh(mb.o, root, *c);
+    }
+    ref<task> decimate = NEW(decimatetask, c->pm, mb.cellsize, 0);
+    ref<task> finish = NEW(lodtask, mb, *c, 0);
+    decimate->starts(*finish);
+    finish->ends(*this);
+    finish->scheduled();
+    decimate->scheduled();
   }
 
-  mesh &m;
-  procmesh &pm;
+  meshbuilder &mb;
+  iso::octree::node &root;
 };
 
-// task to build the mesh from a "contoured" octree
-struct meshbuildtask : public task {
-  INLINE meshbuildtask(mesh &m, iso::octree &o, float cellsize, int waiternum) :
-    task("meshbuildtask", 1, waiternum), m(m), o(o), cellsize(cellsize)
+// stitch the chunks together and output the final mesh. with a sink, only the
+// seams are left to output
+struct stitchtask : public task {
+  INLINE stitchtask(meshbuilder &mb, mesh *m, int waiternum) :
+    task("stitchtask", 1, waiternum), mb(mb), m(m)
   {}
+  virtual ~stitchtask() { DEL(&mb); }
 
   virtual void run(u32) {
-    // create all tasks needed for the mesh processing
-    ref<task> init = NEW(isomeshtask, o, pm);
-    ref<task> decimate[DECIMATION_NUM];
-    loopi(DECIMATION_NUM) decimate[i] = NEW(decimatetask, pm, cellsize);
-    ref<task> finish = NEW(finishtask, m, pm);
-
-    // handle dependencies and completion of parent task
-    init->starts(*decimate[0]);
-    rangei(1,DECIMATION_NUM) decimate[i-1]->starts(*decimate[i]);
-    decimate[DECIMATION_NUM-1]->starts(*finish);
-    finish->ends(*this);
+    const iso::stagetimer timer(iso::STAGE_STITCH);
+
+    // chunks are completed in any order. we sort them for a deterministic
+    // output
+    auto &chunks = mb.chunks;
+    quicksort(chunks.begin(), chunks.end(), [](const meshchunk *c0, const meshchunk *c1) {
+      const auto p0 = c0->pmin, p1 = c1->pmin;
+      return p0.z != p1.z ? p0.z < p1.z : (p0.y != p1.y ? p0.y < p1.y : p0.x < p1.x);
+    });
+    if (mb.sink != NULL)
+      emitseams();
+    else
+      stitch();
+    con::out("iso: final: %d chunks", chunks.length());
+  }
 
-    // schedule everything
-    finish->scheduled();
-    loopi(DECIMATION_NUM) decimate[i]->scheduled();
-    init->scheduled();
+  // chunks are merged with their seams. border points are not locked anymore
+  // and a last pass decimates around the seams like for the clusters
+  void stitch() {
+    auto &chunks = mb.chunks;
+    vector<u32> base(chunks.length());
+    procmesh pm;
+    loopv(chunks) {
+      const auto &c = chunks[i]->pm;
+      base[chunks[i]->id] = pm.pos.length();
+      loopvj(c.pos) {
+        pm.pos.add(c.pos[j]);
+        pm.key.add(-1);
+      }
+      loopvj(c.idx) pm.idx.add(c.idx[j]+base[chunks[i]->id]);
+      loopvj(c.mat) pm.mat.add(c.mat[j]);
+      chunks[i]->pm.destroy();
+    }
+
+    // seams use the locked points of the chunks. points that no chunk used
+    // are appended here
+    const auto seamfirst = pm.idx.length();
+    loopv(chunks) {
+      const auto &seams = chunks[i]->seams;
+      loopvj(seams) {
+        const auto &q = seams[j];
+        iso::octree::qefpoint *pt[4];
+        bool missingpoint = false;
+        loopk(4) if ((pt[k] = getpoint(mb.o, q.pos[k])) == NULL) missingpoint = true;
+        if (missingpoint) continue;
+        const auto tri = findbestmesh(pt).tri;
+        loopk(2) {
+          const auto t = tri[k];
+          if (isdegenerated(pt[t[0]],pt[t[1]],pt[t[2]]))
+            continue;
+          pm.mat.add(q.mat);
+          loopl(3) {
+            const auto qef = pt[t[l]];
+            if (qef->idx == -1) {
+              qef->idx = pm.pos.length();
+              qef->chunk = ~0u;
+              pm.pos.add(qef->pos);
+              pm.key.add(-1);
+            }
+            pm.idx.add(qef->chunk == ~0u ? qef->idx : base[qef->chunk]+qef->idx);
+          }
+        }
+      }
+    }
+    if (pm.idx.length() != seamfirst) {
+      const iso::stagetimer timer(iso::STAGE_DECIMATE);
+      decimatepass(pm, mb.cellsize, 0);
+    }
+    sharpenmesh(pm);
+    optimizemesh(pm);
+    con::out("iso: final: %d vertices", pm.pos.length());
+    con::out("iso: final: %d triangles", pm.trinum());
+    vector<segment> seg;
+    buildsegments(seg, pm.mat, 0);
+    initmesh(*m, pm.pos, pm.nor, pm.idx, seg);
   }
 
-  mesh &m;
-  iso::octree &o;
-  float cellsize;
-  procmesh pm;
+  // the leaves are gone. seams only use the border cells of the chunks
+  void emitseams() {
+    auto &chunks = mb.chunks;
+    vector<int> mapping(mb.seampos.length());
+    loopv(mapping) mapping[i] = -1;
+    vector<vec3f> pos, nor;
+    vector<u32> idx, mat;
+    loopv(chunks) {
+      const auto &seams = chunks[i]->seams;
+      loopvj(seams) {
+        const auto &q = seams[j];
+        iso::octree::qefpoint pts[4], *pt[4];
+        bool missingpoint = false;
+        loopk(4) {
+          const auto it = mb.border.find(cellkey(q.pos[k]));
+          if (it == mb.border.end()) {
+            missingpoint = true;
+            break;
+          }
+          pts[k].pos = mb.seampos[it->second];
+          pts[k].idx = it->second;
+          pt[k] = pts+k;
+        }
+        if (missingpoint) continue;
+        const auto tri = findbestmesh(pt).tri;
+        loopk(2) {
+          const auto t = tri[k];
+          if (isdegenerated(pt[t[0]]->idx,pt[t[1]]->idx,pt[t[2]]->idx))
+            continue;
+          mat.add(q.mat);
+          loopl(3) {
+            const auto v = pt[t[l]]->idx;
+            if (mapping[v] == -1) {
+              mapping[v] = pos.length();
+              pos.add(mb.seampos[v]);
+              nor.add(mb.seamnor[v]);
+            }
+            idx.add(mapping[v]);
+          }
+        }
+      }
+    }
+    con::out("iso: final: %d seam triangles", idx.length()/3);
+    if (idx.length() == 0) return;
+    vector<segment> seg;
+    buildsegments(seg, mat, 0);
+    seamnormals(pos, nor, idx, 0);
+    mesh seam;
+    initmesh(seam, pos, nor, idx, seg);
+    mb.sink(seam, SEAMLOD, mb.udata);
+    seam.destroy();
+  }
+
+  meshbuilder &mb;
+  mesh *m;
 };
 
-ref<task> buildmesh(mesh &m, iso::octree &o, float cellsize, int waiternum) {
-  return NEW(meshbuildtask, m, o, cellsize, waiternum);
+meshbuilder *startmesh(iso::octree &o, float cellsize, meshsink sink,
+                       void *udata, u32 lodnum)
+{
+  assert(lodnum >= 1 && (lodnum == 1 || sink != NULL));
+  return NEW(meshbuilder, o, cellsize, sink, udata, lodnum);
+}
+ref<task> buildchunk(meshbuilder &mb, const vec3i &org, u32 level) {
+  const auto root = mb.o.findnode(org, level);
+  assert(root != NULL && root->level == level);
+  return NEW(chunktask, mb, *root);
+}
+ref<task> finishmesh(meshbuilder &mb, mesh &m, int waiternum) {
+  return NEW(stitchtask, mb, &m, waiternum);
+}
+ref<task> finishmesh(meshbuilder &mb, int waiternum) {
+  assert(mb.sink != NULL && "chunked output requires a sink");
+  return NEW(stitchtask, mb, (mesh*) NULL, waiternum);
 }
 
 /*-------------------------------------------------------------------------
@@ -719,36 +1508,287 @@ void mesh::init(vec3f *pos, vec3f *nor, u32 *index,
   m_segmentnum = segn;
 }
 
-void store(const char *filename, const mesh &m) {
+/*-------------------------------------------------------------------------
+ - mesh container. a header is followed by the payload of the given format.
+ - the raw payload is segments, positions, normals and indices, each array
+ - aligned on MESH_ALIGN bytes. the compact payload is:
+ - segments, then the origin and the step of the position grid, then the
+ - grid coordinates of the vertices as zigzag varint deltas, then 2x16 bits
+ - octahedral normals, then indices as zigzag varint deltas restarting at
+ - every segment
+ -------------------------------------------------------------------------*/
+static const char MESH_MAGIC[4] = {'q','m','s','h'};
+static const u32 MESH_VERSION = 3;
+static const u32 MESH_ALIGN = 16;
+static const u32 MESH_GRIDMAX = (1u<<21)-1; // largest grid coordinate
+
+struct meshheader {
+  char magic[4];
+  u32 version, format;
+  u32 vertnum, indexnum, segmentnum;
+  u32 size;     // payload size in bytes
+  u32 checksum; // murmur hash of the payload
+  u64 scene;    // meshkey fields
+  u32 revision, cellnum;
+  float cellsize, org[3];
+};
+
+static bool samekey(const meshheader &header, const meshkey &key) {
+  return header.scene == key.scene &&
+         header.revision == key.revision &&
+         header.cellnum == key.cellnum &&
+         header.cellsize == key.cellsize &&
+         header.org[0] == key.org.x &&
+         header.org[1] == key.org.y &&
+         header.org[2] == key.org.z;
+}
+
+INLINE u32 meshalign(u32 x) { return (x+MESH_ALIGN-1) & ~(MESH_ALIGN-1); }
+
+struct rawlayout {
+  rawlayout(u32 vertnum, u32 indexnum, u32 segmentnum) {
+    segment = 0;
+    pos = meshalign(segment + segmentnum*sizeof(geom::segment));
+    nor = meshalign(pos + vertnum*sizeof(vec3f));
+    index = meshalign(nor + vertnum*sizeof(vec3f));
+    size = meshalign(index + indexnum*sizeof(u32));
+  }
+  u32 segment, pos, nor, index, size;
+};
+
+static void putbytes(vector<u8> &out, const void *data, u32 size) {
+  const auto first = out.length();
+  out.setsize(first+size);
+  memcpy(&out[first], data, size);
+}
+template <typename T> INLINE void put(vector<u8> &out, const T &x) {
+  putbytes(out, &x, sizeof(T));
+}
+static void putvarint(vector<u8> &out, u32 x) {
+  while (x >= 0x80) {
+    out.add(u8(x|0x80));
+    x >>= 7;
+  }
+  out.add(u8(x));
+}
+static bool getvarint(const u8 *&data, const u8 *end, u32 &x) {
+  x = 0;
+  for (u32 shift = 0;; shift += 7) {
+    if (data == end || shift > 28) return false;
+    const auto byte = *data++;
+    x |= u32(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) return true;
+  }
+}
+INLINE u32 zigzag(s32 x) { return (u32(x) << 1) ^ u32(x >> 31); }
+INLINE s32 unzigzag(u32 x) { return s32(x >> 1) ^ -s32(x & 1); }
+
+INLINE s16 snorm16(float x) { return s16(roundf(clamp(x, -1.f, 1.f) * 32767.f)); }
+static void octencode(const vec3f &n, s16 &x, s16 &y) {
+  const auto l1 = abs(n.x) + abs(n.y) + abs(n.z);
+  if (l1 == 0.f) {
+    x = y = 0;
+    return;
+  }
+  auto u = n.x/l1, v = n.y/l1;
+  if (n.z < 0.f) {
+    const auto fu = (1.f-abs(v)) * (u >= 0.f ? 1.f : -1.f);
+    const auto fv = (1.f-abs(u)) * (v >= 0.f ? 1.f : -1.f);
+    u = fu;
+    v = fv;
+  }
+  x = snorm16(u);
+  y = snorm16(v);
+}
+static vec3f octdecode(s16 x, s16 y) {
+  auto u = float(x) / 32767.f, v = float(y) / 32767.f;
+  const auto z = 1.f - abs(u) - abs(v);
+  if (z < 0.f) {
+    const auto fu = (1.f-abs(v)) * (u >= 0.f ? 1.f : -1.f);
+    const auto fv = (1.f-abs(u)) * (v >= 0.f ? 1.f : -1.f);
+    u = fu;
+    v = fv;
+  }
+  return normalize(vec3f(u, v, z));
+}
+
+static void storecompact(vector<u8> &out, const mesh &m) {
+  putbytes(out, m.m_segment, m.m_segmentnum*sizeof(segment));
+
+  // positions are snapped on one grid spanning the whole mesh such that
+  // equal positions always get equal coordinates. vertices are numbered by
+  // first use so consecutive ones are close
+  if (m.m_vertnum == 0) return;
+  auto pmin = m.m_pos[0], pmax = m.m_pos[0];
+  loopi(m.m_vertnum) {
+    pmin = min(pmin, m.m_pos[i]);
+    pmax = max(pmax, m.m_pos[i]);
+  }
+  const auto step = (pmax-pmin) / float(MESH_GRIDMAX);
+  vec3f rcp;
+  loopj(3) rcp[j] = step[j] == 0.f ? 0.f : 1.f/step[j];
+  put(out, pmin);
+  put(out, step);
+  vec3i prevgrid(zero);
+  loopi(m.m_vertnum) {
+    const auto q = (m.m_pos[i]-pmin)*rcp;
+    vec3i grid;
+    loopj(3) grid[j] = int(clamp(roundf(q[j]), 0.f, float(MESH_GRIDMAX)));
+    loopj(3) putvarint(out, zigzag(grid[j]-prevgrid[j]));
+    prevgrid = grid;
+  }
+
+  loopi(m.m_vertnum) {
+    s16 x, y;
+    octencode(m.m_nor[i], x, y);
+    put(out, x);
+    put(out, y);
+  }
+
+  vector<bool> restart(m.m_indexnum);
+  loopv(restart) restart[i] = false;
+  loopi(m.m_segmentnum) if (m.m_segment[i].start < m.m_indexnum)
+    restart[m.m_segment[i].start] = true;
+  s32 prev = 0;
+  loopi(m.m_indexnum) {
+    if (restart[i]) prev = 0;
+    putvarint(out, zigzag(s32(m.m_index[i])-prev));
+    prev = s32(m.m_index[i]);
+  }
+}
+
+static bool loadcompact(const u8 *data, const u8 *end, mesh &m) {
+#define GET(DST, SIZE) do {\
+  if (u32(end-data) < u32(SIZE)) return false;\
+  memcpy(DST, data, SIZE);\
+  data += SIZE;\
+} while (0)
+  GET(m.m_segment, m.m_segmentnum*sizeof(segment));
+  if (m.m_vertnum == 0) return data == end && m.m_indexnum == 0;
+  float org[3], step[3];
+  GET(org, sizeof(org));
+  GET(step, sizeof(step));
+  const vec3f porg(org[0], org[1], org[2]), pstep(step[0], step[1], step[2]);
+  s32 grid[3] = {0,0,0};
+  loopi(m.m_vertnum) {
+    loopj(3) {
+      u32 x;
+      if (!getvarint(data, end, x)) return false;
+      grid[j] += unzigzag(x);
+      if (u32(grid[j]) > MESH_GRIDMAX) return false;
+    }
+    m.m_pos[i] = porg + pstep*vec3f(float(grid[0]), float(grid[1]), float(grid[2]));
+  }
+  loopi(m.m_vertnum) {
+    s16 n[2];
+    GET(n, sizeof(n));
+    m.m_nor[i] = octdecode(n[0], n[1]);
+  }
+#undef GET
+
+  vector<bool> restart(m.m_indexnum);
+  loopv(restart) restart[i] = false;
+  loopi(m.m_segmentnum) if (m.m_segment[i].start < m.m_indexnum)
+    restart[m.m_segment[i].start] = true;
+  s32 prev = 0;
+  loopi(m.m_indexnum) {
+    u32 x;
+    if (!getvarint(data, end, x)) return false;
+    if (restart[i]) prev = 0;
+    prev += unzigzag(x);
+    if (u32(prev) >= m.m_vertnum) return false;
+    m.m_index[i] = u32(prev);
+  }
+  return data == end;
+}
+
+bool store(const char *filename, const mesh &m, meshformat format,
+           const meshkey &key)
+{
+  vector<u8> payload;
+  if (format == MESH_RAW) {
+    const rawlayout layout(m.m_vertnum, m.m_indexnum, m.m_segmentnum);
+    payload.setsize(layout.size);
+    memset(&payload[0], 0, layout.size);
+    memcpy(&payload[layout.segment], m.m_segment, m.m_segmentnum*sizeof(segment));
+    memcpy(&payload[layout.pos], m.m_pos, m.m_vertnum*sizeof(vec3f));
+    memcpy(&payload[layout.nor], m.m_nor, m.m_vertnum*sizeof(vec3f));
+    memcpy(&payload[layout.index], m.m_index, m.m_indexnum*sizeof(u32));
+  } else
+    storecompact(payload, m);
+
+  meshheader header;
+  memcpy(header.magic, MESH_MAGIC, sizeof(MESH_MAGIC));
+  header.version = MESH_VERSION;
+  header.format = format;
+  header.vertnum = m.m_vertnum;
+  header.indexnum = m.m_indexnum;
+  header.segmentnum = m.m_segmentnum;
+  header.size = payload.length();
+  header.checksum = murmurhash2(payload.length() ? &payload[0] : NULL, payload.length());
+  header.scene = key.scene;
+  header.revision = key.revision;
+  header.cellnum = key.cellnum;
+  header.cellsize = key.cellsize;
+  loopi(3) header.org[i] = key.org[i];
+
   auto f = fopen(filename, "wb");
-  assert(f);
-  fwrite(&m.m_vertnum, sizeof(u32), 1, f);
-  fwrite(&m.m_indexnum, sizeof(u32), 1, f);
-  fwrite(&m.m_segmentnum, sizeof(u32), 1, f);
-  fwrite(m.m_pos, sizeof(vec3f) * m.m_vertnum, 1, f);
-  fwrite(m.m_nor, sizeof(vec3f) * m.m_vertnum, 1, f);
-  fwrite(m.m_index, sizeof(u32) * m.m_indexnum, 1, f);
-  fwrite(m.m_segment, sizeof(segment) * m.m_segmentnum, 1, f);
-  fclose(f);
-}
-
-bool load(const char *filename, mesh &m) {
-  auto f = fopen(filename, "rb");
-  if (f==NULL) return false;
+  if (f == NULL) return false;
+  auto ok = fwrite(&header, sizeof(header), 1, f) == 1;
+  if (payload.length())
+    ok = ok && fwrite(&payload[0], payload.length(), 1, f) == 1;
+  return fclose(f) == 0 && ok;
+}
+
+bool load(const char *filename, mesh &m, const meshkey *key) {
+  size_t size;
+  const auto map = (u8*) sys::mapfile(filename, size);
+  if (map == NULL) return false;
+  meshheader header;
+  const auto payload = map + sizeof(header);
+  if (size < sizeof(header)) {
+    sys::unmapfile(map, size);
+    return false;
+  }
+  memcpy(&header, map, sizeof(header));
+  if (memcmp(header.magic, MESH_MAGIC, sizeof(MESH_MAGIC)) != 0 ||
+      header.version != MESH_VERSION ||
+      header.size != size-sizeof(header) ||
+      (key != NULL && !samekey(header, *key)) ||
+      header.checksum != murmurhash2(payload, header.size)) {
+    sys::unmapfile(map, size);
+    return false;
+  }
+
+  // raw meshes directly point into the mapped file
   m.destroy();
-  fread(&m.m_vertnum, sizeof(u32), 1, f);
-  fread(&m.m_indexnum, sizeof(u32), 1, f);
-  fread(&m.m_segmentnum, sizeof(u32), 1, f);
+  m.m_vertnum = header.vertnum;
+  m.m_indexnum = header.indexnum;
+  m.m_segmentnum = header.segmentnum;
+  if (header.format == MESH_RAW) {
+    const rawlayout layout(header.vertnum, header.indexnum, header.segmentnum);
+    if (layout.size != header.size) {
+      sys::unmapfile(map, size);
+      return false;
+    }
+    m.m_segment = (segment*) (payload + layout.segment);
+    m.m_pos = (vec3f*) (payload + layout.pos);
+    m.m_nor = (vec3f*) (payload + layout.nor);
+    m.m_index = (u32*) (payload + layout.index);
+    m.m_map = map;
+    m.m_mapsize = size;
+    return true;
+  }
+
   m.m_pos = (vec3f*) MALLOC(sizeof(vec3f) * m.m_vertnum);
   m.m_nor = (vec3f*) MALLOC(sizeof(vec3f) * m.m_vertnum);
   m.m_index = (u32*) MALLOC(sizeof(u32) * m.m_indexnum);
   m.m_segment = (segment*) MALLOC(sizeof(segment) * m.m_segmentnum);
-  fread(m.m_pos, sizeof(vec3f) * m.m_vertnum, 1, f);
-  fread(m.m_nor, sizeof(vec3f) * m.m_vertnum, 1, f);
-  fread(m.m_index, sizeof(u32) * m.m_indexnum, 1, f);
-  fread(m.m_segment, sizeof(segment) * m.m_segmentnum, 1, f);
-  fclose(f);
-  return true;
+  const auto ok = header.format == MESH_COMPACT &&
+                  loadcompact(payload, payload+header.size, m);
+  sys::unmapfile(map, size);
+  if (!ok) m.destroy();
+  return ok;
 }
 } /* namespace geom */
 } /* namespace q */
@@ -33,14 +33,53 @@ struct mesh {
   u32 m_vertnum;
   u32 m_indexnum;
   u32 m_segmentnum;
+  void *m_map; // file the arrays point into if the mesh was mapped
+  size_t m_mapsize;
 };
 
-// create a task to build a mesh from a "contoured" octree
-ref<task> buildmesh(mesh &m, iso::octree &o, float cellsize, int waitnum = 1);
+// receive the chunks of a mesh built with chunked output. calls are
+// serialized and the mesh is destroyed as soon as the sink returns. each chunk
+// is emitted once per level of details (0 being the finest). the seams between
+// chunks are emitted last with SEAMLOD and fit any level of details
+typedef void (*meshsink)(const mesh &m, u32 lod, void *udata);
+static const u32 SEAMLOD = ~0u;
 
-// load/store the mesh in the given stream
-void store(const char *filename, const mesh &m);
-bool load(const char *filename, mesh &m);
+// build a mesh from a "contoured" octree. the mesh is built per chunk i.e. per
+// octree subtree as soon as the subtree is contoured. chunks are then stitched
+// together by the finish task which also releases the mesh builder. with a
+// sink, every chunk is emitted as soon as it is done and its octree leaves are
+// freed. the finish task then only emits the seams between chunks
+struct meshbuilder;
+meshbuilder *startmesh(iso::octree &o, float cellsize,
+                       meshsink sink = NULL, void *udata = NULL,
+                       u32 lodnum = 1);
+ref<task> buildchunk(meshbuilder &mb, const vec3i &org, u32 level);
+ref<task> finishmesh(meshbuilder &mb, mesh &m, int waitnum = 1);
+ref<task> finishmesh(meshbuilder &mb, int waitnum = 1);
+
+// meshes are stored in a versioned container. the compact format snaps
+// positions on a grid over the mesh bounds, octahedral-encodes normals and
+// codes positions and indices as varint deltas. the raw format is mapped in
+// memory as is
+enum meshformat { MESH_COMPACT, MESH_RAW };
+
+// what a mesh was built from: the hash of the csg tree, the revision of the
+// mesher and the dc parameters. it is kept in the container header
+struct meshkey {
+  INLINE meshkey() : scene(0), revision(0), cellnum(0), cellsize(0.f), org(zero) {}
+  u64 scene;
+  u32 revision, cellnum;
+  float cellsize;
+  vec3f org;
+};
+
+// return false if the file cannot be written
+bool store(const char *filename, const mesh &m, meshformat format = MESH_COMPACT,
+           const meshkey &key = meshkey());
+
+// fails on a missing file, an unknown version, a bad checksum or, if a key
+// is given, on a mesh built from something else
+bool load(const char *filename, mesh &m, const meshkey *key = NULL);
 } /* namespace geom */
 } /* namespace q */
 
@@ -5,12 +5,14 @@
 #include "iso.hpp"
 #include "csg.hpp"
 #include "qef.hpp"
+#include "soa.hpp"
 #include "csgscalar.hpp"
-#include "csgsse.hpp"
-#include "csgavx.hpp"
 #include "geom.hpp"
 #include "base/vector.hpp"
+#include "base/hash_map.hpp"
+#include "base/algorithm.hpp"
 #include "base/task.hpp"
+#include "base/atomics.hpp"
 #include "base/console.hpp"
 
 STATS(iso_num);
@@ -19,19 +21,37 @@ STATS(iso_edge_num);
 STATS(iso_gradient_num);
 STATS(iso_grid_num);
 STATS(iso_octree_num);
+STATS(iso_leaf_num);
 STATS(iso_qef_num);
 STATS(iso_edgepos);
+STATS(iso_shared_field_num);
+STATS(iso_skipped_field_num);
+STATS(iso_chunk_num);
+STATS(iso_leaf_usec);
+STATS(iso_leaf_max_usec);
+STATS(iso_shared_edge_num);
+STATS(iso_arena_bytes);
+STATS(iso_arena_max_bytes);
 
 #if !defined(RELEASE)
 static void stats() {
   STATS_OUT(iso_num);
   STATS_OUT(iso_qef_num);
+  STATS_OUT(iso_leaf_num);
   STATS_OUT(iso_edge_num);
   STATS_RATIO(iso_edgepos_num, iso_edge_num);
   STATS_RATIO(iso_edgepos_num, iso_num);
   STATS_RATIO(iso_gradient_num, iso_num);
   STATS_RATIO(iso_grid_num, iso_num);
   STATS_RATIO(iso_octree_num, iso_num);
+  STATS_OUT(iso_shared_field_num);
+  STATS_OUT(iso_skipped_field_num);
+  STATS_OUT(iso_chunk_num);
+  STATS_OUT(iso_leaf_usec);
+  STATS_OUT(iso_leaf_max_usec);
+  STATS_OUT(iso_shared_edge_num);
+  STATS_OUT(iso_arena_bytes);
+  STATS_OUT(iso_arena_max_bytes);
 }
 #endif /* defined(RELEASE) */
 
@@ -41,17 +61,18 @@ static const q::vec3f debugpos(19.f,3.0f,13.f);
 static const float debugsize = 0.8f;
 #endif /* DEBUGOCTREE */
 
-//#define CSGVER csg::avx
-//#define CSGVER csg::sse
-#define CSGVER csg
-
 namespace q {
 namespace iso {
 
 static const u32 SUBGRIDDEPTH = ilog2(SUBGRID);
-static const auto DEFAULT_GRAD_STEP = 1e-3f;
 static const int MAX_STEPS = 8;
+static const auto EDGE_TOLERANCE = 1e-3f; // in cell size unit
+static const auto EDGE_MIN_WIDTH = 1.f/float(1<<MAX_STEPS); // same
+static const auto EDGE_MIN_T = 1e-3f; // never output an edge end point
 static const double QEM_LEAF_MIN_ERROR = 1e-6;
+static const u32 CHUNK_NUM = 32; // chunks per contouring task
+static const u32 SUBTREEDEPTH = 5; // depth of subtrees built by one task
+static const u32 SUBTREESLAB = 64*1024; // octree slab size of one subtree
 
 INLINE pair<vec3i,u32> edge(vec3i start, vec3i end) {
   const auto lower = select(lt(start,end), start, end);
@@ -86,12 +107,13 @@ static const int interptable[12][2] = {
   {0,1},{1,2},{2,3},{3,0},{4,5},{5,6},
   {6,7},{7,4},{0,4},{1,5},{2,6},{3,7}
 };
-static const u32 octreechildmap[8] = {0, 4, 3, 7, 1, 5, 2, 6};
 static const pair<int,int> airmat = makepair(csg::MAT_AIR_INDEX, csg::MAT_AIR_INDEX);
 static const u32 FIELDDIM = SUBGRID+2;
 static const u32 FIELDNUM = FIELDDIM*FIELDDIM*FIELDDIM;
 static const u32 QEFNUM = SUBGRID*SUBGRID*SUBGRID;
 static const u32 NOINDEX = ~0x0u;
+static const u32 FIELDWORDS = (FIELDNUM+63)/64+1; // one extra word to read rows
+static const u32 ROWMASK = (1u<<FIELDDIM)-1;
 
 /*-------------------------------------------------------------------------
  - leafoctree implementation
@@ -104,6 +126,7 @@ void leafoctreebase::init() {
 void leafoctreebase::insert(vec3i xyz, int ptidx) {
   assert(all(ge(xyz,vec3i(zero))) && "out-of-bound vertex");
   assert(all(lt(xyz,vec3i(SUBGRID))) && "out-of-bound vertex");
+  const auto code = morton(xyz);
   u32 level = 0, idx = 0;
   for (;;) {
     if (level == SUBGRIDDEPTH) {
@@ -119,63 +142,80 @@ void leafoctreebase::insert(vec3i xyz, int ptidx) {
       root.setsize(childidx+8);
       loopi(8) root[childidx+i].setemptyleaf();
     }
-    idx = descend(xyz, level, idx);
+    idx = root[idx].idx + mortonchild(code, SUBGRIDDEPTH-level-1);
     ++level;
   }
 }
 
-int leafoctreebase::getidx(vec3i xyz) {
+int leafoctreebase::getidx(const node *root, vec3i xyz) {
   assert(all(ge(xyz,vec3i(zero))) && "out-of-bound vertex");
   assert(all(lt(xyz,vec3i(SUBGRID))) && "out-of-bound vertex");
+  const auto code = morton(xyz);
   u32 level = 0, idx = 0;
   for (;;) {
     const auto node = &root[idx];
     if (node->empty) return -1;
     if (node->isleaf) return node->idx;
-    idx = descend(xyz, level, idx);
+    idx = node->idx + mortonchild(code, SUBGRIDDEPTH-level-1);
     ++level;
   }
 }
 
-INLINE u32 leafoctreebase::descend(vec3i &xyz, u32 level, u32 idx) {
-  const auto logsize = vec3i(SUBGRIDDEPTH-level-1);
-  const auto bits = xyz >> logsize;
-  const auto child = octreechildmap[bits.x | (bits.y<<1) | (bits.z<<2)];
-  assert(all(ge(xyz, icubev[child] << logsize)));
-  xyz -= icubev[child] << logsize;
-  idx = root[idx].idx+child;
-  return idx;
-}
-
 /*-------------------------------------------------------------------------
  - global octree implementation
  -------------------------------------------------------------------------*/
-octree::node::~node() {
-  if (isleaf)
-    SAFE_DEL(leaf);
-  else
-    SAFE_DELA(children);
+// header of the memory blocks the octree nodes and leaves are taken from
+struct octree::slab {
+  slab *next;
+  INLINE char *data() { return (char*) (this+1); }
+};
+
+octree::octree(u32 dim) :
+  m_slabs(NULL), m_dim(dim), m_logdim(ilog2(dim)) {}
+
+octree::~octree() {
+  loopv(m_arenas) DEL(m_arenas[i]);
+  while (m_slabs != NULL) {
+    const auto next = m_slabs->next;
+    FREE(m_slabs);
+    m_slabs = next;
+  }
 }
 
 const octree::node *octree::findleaf(vec3i xyz) const {
+  return findnode(xyz, m_logdim);
+}
+
+const octree::node *octree::findnode(vec3i xyz, u32 maxlevel) const {
   if (any(lt(xyz,vec3i(zero))) || any(ge(xyz,vec3i(m_dim)))) return NULL;
-  int level = 0;
+  return findnode(morton(xyz), maxlevel);
+}
+
+const octree::node *octree::findleaf(u64 code) const {
+  return findnode(code, m_logdim);
+}
+
+// the morton code of the cell gives the child to take at every level
+const octree::node *octree::findnode(u64 code, u32 maxlevel) const {
+  assert(code < u64(1) << (3*m_logdim) && "out-of-bound morton code");
   const node *node = &m_root;
-  for (;;) {
-    if (node->isleaf) return node;
-    assert(m_logdim > u32(level));
-    const auto logsize = vec3i(m_logdim-level-1);
-    const auto bits = xyz >> logsize;
-    const auto child = octreechildmap[bits.x | (bits.y<<1) | (bits.z<<2)];
-    assert(all(ge(xyz, icubev[child] << logsize)));
-    xyz -= icubev[child] << logsize;
-    node = node->children + child;
-    ++level;
+  for (u32 level = 0;; ++level) {
+    if (node->isleaf || level == maxlevel) return node;
+    assert(m_logdim > level);
+    node = node->children + mortonchild(code, m_logdim-level-1);
   }
   assert("unreachable" && false);
   return NULL;
 }
 
+const octree::node *octree::findneighbor(const node &n, u32 face) const {
+  assert(face < 6 && "face is out of bound");
+  const auto cellnum = int(m_dim >> n.level);
+  auto xyz = n.org;
+  xyz[face/2] += face&1 ? cellnum : -cellnum;
+  return findnode(xyz, n.level);
+}
+
 struct edgeitem {
   vec3f org, p0, p1;
   float v0, v1;
@@ -184,7 +224,7 @@ struct edgeitem {
 
 struct CACHE_LINE_ALIGNED edgestack {
   array<edgeitem,csg::MAXPOINTNUM> it;
-  csg::array3f p, pos;
+  csg::array3f p, pos, g;
   csg::arrayf d, nd;
   csg::arrayi m;
 };
@@ -196,6 +236,47 @@ INLINE pair<vec3i,int> getedge(const vec3i &start, const vec3i &end) {
   return makepair(lower, delta.y+2*delta.z);
 }
 
+// intersection of the surface with an edge. p is relative to its lower end
+struct edgepoint {
+  vec3f p, n;
+  vec2i mat;
+};
+
+/*-------------------------------------------------------------------------
+ - two neighbor leaves evaluate the same two layers of field samples and
+ - the same edges along their common face. the first leaf to finish
+ - publishes them in the face slot. the other one either finds them when it
+ - starts or frees them when it is done. a leaf claims the empty slot before
+ - it writes the slab. if its neighbor finishes in between, it closes the
+ - claimed slot and the publisher frees its own slab. layers and edges are
+ - stored in the
+ - coordinates of the face: k is the layer, j the edge direction and (u,v)
+ - the position along axes (axis+1)%3 and (axis+2)%3
+ -------------------------------------------------------------------------*/
+static const u32 FACEDIM = SUBGRID+1;
+static const u32 FACEFIELDNUM = 2*FIELDDIM*FIELDDIM;
+static const u32 FACEEDGENUM = 2*FACEDIM*FACEDIM;
+
+struct faceslab {
+  fielditem field[FACEFIELDNUM];
+  edgepoint edges[FACEEDGENUM];
+  bool valid[FACEEDGENUM];
+};
+
+struct faceslot {
+  enum {EMPTY, CLAIMED, PUBLISHED, CLOSED};
+  INLINE faceslot() : state(EMPTY), slab(NULL) {}
+  atomic state;
+  faceslab *slab;
+};
+
+INLINE u32 facefield_index(u32 k, u32 u, u32 v) {
+  return (k*FIELDDIM + v)*FIELDDIM + u;
+}
+INLINE u32 faceedge_index(u32 j, u32 u, u32 v) {
+  return (j*FACEDIM + v)*FACEDIM + u;
+}
+
 /*-------------------------------------------------------------------------
  - temporary structure to handle *leaf* mesh data before merging similar
  - vertices using qem
@@ -287,7 +368,7 @@ void procleaf::merge(int idx) {
  -------------------------------------------------------------------------*/
 struct gridbuilder {
   gridbuilder() :
-    m_node(NULL),
+    m_program(NULL),
     m_field(FIELDNUM),
     m_qef_index(QEFNUM),
     m_edge_index(6*FIELDNUM),
@@ -296,13 +377,13 @@ struct gridbuilder {
     m_iorg(zero),
     maxlvl(0),
     level(0)
-  {}
+  {
+    loopi(6) m_faces[i] = NULL;
+    loopi(6) m_shared[i] = NULL;
+  }
   ~gridbuilder() { ALIGNEDFREE(stack); }
 
-  struct edge {
-    vec3f p, n;
-    vec2i mat;
-  };
+  typedef edgepoint edge;
 
   struct qef_output {
     INLINE qef_output(vec3f p, vec3f n, bool valid):p(p),n(n),valid(valid){}
@@ -317,7 +398,13 @@ struct gridbuilder {
   INLINE void setoctree(const octree &o) { m_octree = &o; }
   INLINE void setorg(const vec3f &org) { m_org = org; }
   INLINE void setcellsize(float size) { cellsize = size; }
-  INLINE void setnode(const csg::node *node) { m_node = node; }
+  INLINE void setprogram(const csg::program *program) {
+    m_program = program;
+    m_regs.reserve(program);
+  }
+  INLINE void setfaces(faceslot *const *faces) {
+    loopi(6) m_faces[i] = faces[i];
+  }
   INLINE u32 qef_index(const vec3i &xyz) const {
     assert(all(ge(xyz,vec3i(zero))) && all(lt(xyz,vec3i(SUBGRID))));
     return xyz.x + (xyz.y + xyz.z * SUBGRID) * SUBGRID;
@@ -333,38 +420,245 @@ struct gridbuilder {
   }
   INLINE fielditem &field(const vec3i &xyz) {return m_field[field_index(xyz)];}
 
+  // face f is along axis f/2. even faces are the low ones
+  INLINE int facelayer(int f) const { return f&1 ? SUBGRID : 0; }
+
+  // take the data our neighbors already published
+  void fetchfaces() {
+    loopi(6) {
+      m_shared[i] = NULL;
+      const auto slot = m_faces[i];
+      if (slot == NULL) continue;
+      COMPILER_READ_WRITE_BARRIER;
+      if (cmpxchg(slot->state, faceslot::CLOSED, faceslot::PUBLISHED) != faceslot::PUBLISHED)
+        continue;
+      COMPILER_READ_WRITE_BARRIER;
+      m_shared[i] = slot->slab;
+      slot->slab = NULL;
+    }
+  }
+
+  // publish our faces or release the ones our neighbors published while we
+  // were running
+  void publishfaces() {
+    loopi(6) {
+      const auto slot = m_faces[i];
+      if (m_shared[i] != NULL) {
+        DEL(m_shared[i]);
+        m_shared[i] = NULL;
+      }
+      if (slot == NULL) continue;
+      COMPILER_READ_WRITE_BARRIER;
+      const auto state = cmpxchg(slot->state, faceslot::CLAIMED, faceslot::EMPTY);
+      COMPILER_READ_WRITE_BARRIER;
+
+      // we own the slot. only we write the slab pointer
+      if (state == faceslot::EMPTY) {
+        const auto slab = NEWE(faceslab);
+        storeface(i, *slab);
+        slot->slab = slab;
+        COMPILER_READ_WRITE_BARRIER;
+        if (cmpxchg(slot->state, faceslot::PUBLISHED, faceslot::CLAIMED) == faceslot::CLAIMED)
+          continue;
+        COMPILER_READ_WRITE_BARRIER;
+        slot->slab = NULL;
+        DEL(slab);
+      }
+
+      // our neighbor is done and nobody will ever fetch its slab
+      else if (state == faceslot::PUBLISHED) {
+        DEL(slot->slab);
+        slot->slab = NULL;
+        storerelease(slot->state, s32(faceslot::CLOSED));
+      }
+
+      // our neighbor is still writing its slab. it will free it
+      else if (state == faceslot::CLAIMED) {
+        if (cmpxchg(slot->state, faceslot::CLOSED, faceslot::CLAIMED) == faceslot::CLAIMED)
+          continue;
+        COMPILER_READ_WRITE_BARRIER;
+        DEL(slot->slab);
+        slot->slab = NULL;
+        storerelease(slot->state, s32(faceslot::CLOSED));
+      }
+    }
+  }
+
+  void storeface(int f, faceslab &slab) {
+    const auto a = f/2, b = (a+1)%3, c = (a+2)%3;
+    loopk(2) loop(v,FIELDDIM) loop(u,FIELDDIM) {
+      vec3i xyz;
+      xyz[a] = facelayer(f)+k;
+      xyz[b] = u;
+      xyz[c] = v;
+      slab.field[facefield_index(k,u,v)] = field(xyz);
+    }
+    loopi(FACEEDGENUM) slab.valid[i] = false;
+    loopv(delayed_edges) {
+      const auto &e = delayed_edges[i];
+      const auto edge = getedge(icubev[e.second.x], icubev[e.second.y]);
+      const auto lower = e.first + edge.first;
+      if (edge.second == a || lower[a] != facelayer(f)) continue;
+      const auto idx = faceedge_index(edge.second==b?0:1, lower[b], lower[c]);
+      slab.edges[idx] = m_edges[i];
+      slab.valid[idx] = true;
+    }
+  }
+
+  const fielditem *sharedfield(const vec3i &xyz) const {
+    loopi(6) {
+      if (m_shared[i] == NULL) continue;
+      const auto a = i/2, k = xyz[a] - facelayer(i);
+      if (k != 0 && k != 1) continue;
+      const auto u = xyz[(a+1)%3], v = xyz[(a+2)%3];
+      return &m_shared[i]->field[facefield_index(k,u,v)];
+    }
+    return NULL;
+  }
+
+  const edge *sharededge(const vec3i &lower, int axis) const {
+    loopi(6) {
+      const auto a = i/2;
+      if (m_shared[i] == NULL || a == axis || lower[a] != facelayer(i)) continue;
+      const auto b = (a+1)%3, c = (a+2)%3;
+      const auto idx = faceedge_index(axis==b?0:1, lower[b], lower[c]);
+      if (m_shared[i]->valid[idx]) return &m_shared[i]->edges[idx];
+    }
+    return NULL;
+  }
+
+  // fill the block with a constant. only the sign (and the material) of these
+  // points matter since they are too far from the surface to be used by edges
+  void fillblock(const vec3i &start, const vec3i &end, const fielditem &item) {
+    int sharednum = 0;
+    loopxyz(start, end) {
+      const auto shared = sharedfield(xyz);
+      if (shared != NULL) {
+        field(xyz) = *shared;
+        ++sharednum;
+      } else
+        field(xyz) = item;
+    }
+    STATS_ADD(iso_shared_field_num, sharednum);
+    STATS_ADD(iso_skipped_field_num, reducemul(end-start)-sharednum);
+  }
+
+  // evaluate the centers of the given blocks. blocks that can not contain any
+  // point closer than two cells to the surface are filled with a constant.
+  // since csg distances are lipschitz, a block is skipped when the distance
+  // of its center is larger than its half diagonal plus this margin. the
+  // other blocks are split in the output vector. blocks of 2^3 points are
+  // output as is to be evaluated
+  void skipblocks(const vector<vec3i> &blocks, int size, vector<vec3i> &out) {
+    auto &pos = stack->p;
+    auto &d = stack->d;
+    auto &m = stack->m;
+    const auto len = blocks.length();
+    for (int i = 0; i < len; i += 64) {
+      const int num = min(64, len-i);
+      auto box = aabb::empty();
+      loopj(num) {
+        const auto start = blocks[i+j];
+        const auto end = min(start+size, vec3i(FIELDDIM));
+        const auto pmin = vertex(start), pmax = vertex(end-1);
+        csg::set(pos, (pmin+pmax)*0.5f, j);
+        box.pmin = min(box.pmin, pmin);
+        box.pmax = max(box.pmax, pmax);
+      }
+      box.pmin -= 2.f*cellsize;
+      box.pmax += 2.f*cellsize;
+      csg::dist(m_program, m_regs, pos, NULL, d, m, NULL, num, box);
+      STATS_ADD(iso_num, num);
+      STATS_ADD(iso_grid_num, num);
+      loopj(num) {
+        const auto start = blocks[i+j];
+        const auto end = min(start+size, vec3i(FIELDDIM));
+        const auto radius = 0.5f*length(vertex(end-1)-vertex(start));
+        const auto bound = abs(d[j]) - radius;
+        if (bound > 2.f*cellsize) {
+          fillblock(start, end, fielditem(d[j]<0.f ? -bound : bound, m[j]));
+          continue;
+        }
+        if (size == 2) {
+          out.add(start);
+          continue;
+        }
+        const auto half = size/2;
+        stepxyz(start, end, vec3i(half)) out.add(sxyz);
+      }
+    }
+  }
+
   void initfield() {
-    stepxyz(vec3i(zero), vec3i(FIELDDIM), vec3i(4)) {
-      auto &pos = stack->p;
-      auto &d = stack->d;
-      auto &m = stack->m;
-      const auto p = vertex(sxyz);
-      const auto box = aabb(p-2.f*cellsize, p+6.f*cellsize);
-      int index = 0;
-      const auto end = min(sxyz+4,vec3i(FIELDDIM));
-      loopxyz(sxyz, end) csg::set(pos, vertex(xyz), index++);
-      CSGVER::dist(m_node, pos, NULL, d, m, index, box);
+    const stagetimer timer(STAGE_INITFIELD);
+    // coarse to fine. we classify blocks of 8^3, 4^3 and 2^3 points and only
+    // evaluate the points of the 2^3 blocks close enough to the surface
+    m_blocks[0].setsize(0);
+    stepxyz(vec3i(zero), vec3i(FIELDDIM), vec3i(8)) m_blocks[0].add(sxyz);
+    int src = 0;
+    for (int size = 8; size >= 2; size /= 2, src ^= 1) {
+      m_blocks[src^1].setsize(0);
+      skipblocks(m_blocks[src], size, m_blocks[src^1]);
+    }
+
+    // run the remaining blocks with packets of (up-to) 64 points
+    const auto &blocks = m_blocks[src];
+    auto &pos = stack->p;
+    auto &d = stack->d;
+    auto &m = stack->m;
+    for (int i = 0; i < blocks.length(); i += 8) {
+      const int num = min(8, blocks.length()-i);
+      auto box = aabb::empty();
+      int index = 0, sharednum = 0;
+      loopj(num) {
+        const auto start = blocks[i+j];
+        const auto end = min(start+2, vec3i(FIELDDIM));
+        loopxyz(start, end) {
+          const auto shared = sharedfield(xyz);
+          if (shared != NULL) {
+            field(xyz) = *shared;
+            ++sharednum;
+            continue;
+          }
+          const auto p = vertex(xyz);
+          csg::set(pos, p, index++);
+          box.pmin = min(box.pmin, p);
+          box.pmax = max(box.pmax, p);
+        }
+      }
+      STATS_ADD(iso_shared_field_num, sharednum);
+      if (index == 0) continue;
+      box.pmin -= 2.f*cellsize;
+      box.pmax += 2.f*cellsize;
+      csg::dist(m_program, m_regs, pos, NULL, d, m, NULL, index, box);
 #if !defined(NDEBUG)
-      loopi(index) assert(d[i] <= 0.f || m[i] == csg::MAT_AIR_INDEX);
-      loopi(index) assert(d[i] >= 0.f || m[i] != csg::MAT_AIR_INDEX);
+      loopj(index) assert(d[j] <= 0.f || m[j] == csg::MAT_AIR_INDEX);
+      loopj(index) assert(d[j] >= 0.f || m[j] != csg::MAT_AIR_INDEX);
 #endif /* NDEBUG */
       STATS_ADD(iso_num, index);
       STATS_ADD(iso_grid_num, index);
       index = 0;
-      loopxyz(sxyz, end) {
-        field(xyz) = fielditem(d[index], m[index]);
-        ++index;
+      loopj(num) {
+        const auto start = blocks[i+j];
+        const auto end = min(start+2, vec3i(FIELDDIM));
+        loopxyz(start, end) {
+          if (sharedfield(xyz) != NULL) continue;
+          field(xyz) = fielditem(d[index], m[index]);
+          ++index;
+        }
       }
     }
   }
 
   void initedge() {
+    const stagetimer timer(STAGE_INITEDGE);
     m_edge_index.memset(0xff);
     m_edges.setsize(0);
     delayed_edges.setsize(0);
   }
 
   void initqef() {
+    const stagetimer timer(STAGE_INITQEF);
     m_qefnum = 0;
     m_qef_index.memset(0xff);
     delayed_qef.setsize(0);
@@ -387,65 +681,116 @@ struct gridbuilder {
     return edgemap;
   }
 
-  void edgepos(const csg::node *node, edgestack &stack, int num) {
+  // find the intersection of the surface with the edges. edges crossing the
+  // surface (solid to air) use regula falsi with the illinois modification.
+  // edges between two solids only see a material change and fall back to
+  // bisection. lanes are removed from the packet as soon as they converge.
+  // everything done per lane only depends on the lane inputs such that
+  // neighbor leaves still output the exact same results
+  void edgepos(edgestack &stack, int num) {
     assert(num <= 64);
     auto &it = stack.it;
     auto &pos = stack.pos, &p = stack.p;
     auto &d = stack.d;
     auto &m = stack.m;
+    const auto tolerance = EDGE_TOLERANCE * cellsize;
+    u64 secant = 0ull;
+    int lane[64], side[64], activenum = num, evalnum = 0;
+    loopi(num) {
+      lane[i] = i;
+      side[i] = -1;
+      if (it[i].v0 < 0.f && it[i].v1 >= 0.f) secant |= 1ull<<i;
+    }
 
-    loopk(MAX_STEPS) {
+    for (int k = 0; k < MAX_STEPS && activenum != 0; ++k) {
       auto box = aabb::empty();
-      loopi(num) {
-        const auto mid = (it[i].p0 + it[i].p1) * 0.5f;
-        const auto worldmid = it[i].org+cellsize*mid;
-        csg::set(p, mid, i);
-        csg::set(pos, worldmid, i);
-        box.pmin = min(worldmid, box.pmin);
-        box.pmax = max(worldmid, box.pmax);
+      loopj(activenum) {
+        const auto &e = it[lane[j]];
+        const auto t = (secant>>lane[j])&1ull ?
+          clamp(e.v0/(e.v0-e.v1), EDGE_MIN_T, 1.f-EDGE_MIN_T) : 0.5f;
+        const auto x = e.p0 + t*(e.p1-e.p0);
+        const auto worldx = e.org+cellsize*x;
+        csg::set(p, x, j);
+        csg::set(pos, worldx, j);
+        box.pmin = min(worldx, box.pmin);
+        box.pmax = max(worldx, box.pmax);
       }
       box.pmin -= 3.f * cellsize;
       box.pmax += 3.f * cellsize;
-      CSGVER::dist(m_node, pos, NULL, d, m, num, box);
-      if (k != MAX_STEPS-1) {
-        loopi(num) {
-          assert(!isnan(d[i]));
-          if (m[i] == int(it[i].m0)) {
-            it[i].p0 = csg::get(p,i);
-            it[i].v0 = d[i];
+      csg::dist(m_program, m_regs, pos, NULL, d, m, NULL, activenum, box);
+      evalnum += activenum;
+
+      // update the brackets and compact the lanes still to process
+      int next = 0;
+      loopj(activenum) {
+        const auto i = lane[j];
+        auto &e = it[i];
+        const auto x = csg::get(p,j);
+        assert(!isnan(d[j]));
+        bool done = k == MAX_STEPS-1;
+        if ((secant>>i)&1ull) {
+          done |= abs(d[j]) <= tolerance;
+          if (d[j] < 0.f) {
+            if (side[i] == 0) e.v1 *= 0.5f;
+            e.p0 = x;
+            e.v0 = d[j];
+            side[i] = 0;
           } else {
-            it[i].p1 = csg::get(p,i);
-            it[i].v1 = d[i];
+            if (side[i] == 1) e.v0 *= 0.5f;
+            e.p1 = x;
+            e.v1 = d[j];
+            side[i] = 1;
           }
+          done |= distance2(e.p0, e.p1) <= EDGE_MIN_WIDTH*EDGE_MIN_WIDTH;
+        } else if (m[j] == int(e.m0)) {
+          e.p0 = x;
+          e.v0 = d[j];
+        } else {
+          e.p1 = x;
+          e.v1 = d[j];
         }
-      } else {
-        loopi(num) {
-          const auto src = csg::get(p,i);
-          it[i].p0 = src;
+        if (done) {
+          e.p0 = x;
 #if !defined(NDEBUG)
-          assert(!isnan(src.x)&&!isnan(src.y)&&!isnan(src.z));
-          assert(!isinf(src.x)&&!isinf(src.y)&&!isinf(src.z));
+          assert(!isnan(x.x)&&!isnan(x.y)&&!isnan(x.z));
+          assert(!isinf(x.x)&&!isinf(x.y)&&!isinf(x.z));
 #endif /* NDEBUG */
-        }
+        } else
+          lane[next++] = i;
       }
+      activenum = next;
     }
-    STATS_ADD(iso_edgepos_num, num*MAX_STEPS);
-    STATS_ADD(iso_num, num*MAX_STEPS);
+    STATS_ADD(iso_edgepos_num, evalnum);
+    STATS_ADD(iso_num, evalnum);
   }
 
   void finishedges() {
-    const auto len = delayed_edges.length();
+    const stagetimer timer(STAGE_FINISHEDGES);
+    // edges shared with a neighbor that already computed them are copied
+    m_edges.setsize(delayed_edges.length());
+    m_todo_edges.setsize(0);
+    loopv(delayed_edges) {
+      const auto &e = delayed_edges[i];
+      const auto edge = getedge(icubev[e.second.x], icubev[e.second.y]);
+      const auto shared = sharededge(e.first+edge.first, edge.second);
+      if (shared != NULL)
+        m_edges[i] = *shared;
+      else
+        m_todo_edges.add(i);
+    }
+    const auto len = m_todo_edges.length();
     STATS_ADD(iso_edge_num, len);
+    STATS_ADD(iso_shared_edge_num, delayed_edges.length()-len);
     for (int i = 0; i < len; i += 64) {
       auto &it = stack->it;
 
-      // step 1 - run bisection with packets of (up-to) 64 points. we need
+      // step 1 - run root finding with packets of (up-to) 64 points. we need
       // to be careful FP wise. We ensure here that the position computation is
       // invariant from grids to grids such that neighbor grids will output the
       // exact same result
       const int num = min(64, len-i);
       loopj(num) {
-        const auto &e = delayed_edges[i+j];
+        const auto &e = delayed_edges[m_todo_edges[i+j]];
         const auto idx0 = e.second.x, idx1 = e.second.y;
         const auto xyz = e.first;
         const auto edge = getedge(icubev[idx0], icubev[idx1]);
@@ -462,56 +807,81 @@ struct gridbuilder {
           swap(it[j].m0,it[j].m1);
         }
       }
-      edgepos(m_node, *stack, num);
-
-      // step 2 - compute normals for each point using packets of 16x4 points
-      const auto dx = vec3f(DEFAULT_GRAD_STEP, 0.f, 0.f);
-      const auto dy = vec3f(0.f, DEFAULT_GRAD_STEP, 0.f);
-      const auto dz = vec3f(0.f, 0.f, DEFAULT_GRAD_STEP);
-      for (int j = 0; j < num; j += 16) {
-        const int subnum = min(num-j, 16);
-        auto &p = stack->p;
-        auto &d = stack->d;
-        auto &m = stack->m;
-        auto &nd = stack->nd;
-        auto box = aabb::empty();
-        loopk(subnum) {
-          const auto center = it[j+k].org + it[j+k].p0 * cellsize;
-          csg::set(p, center,    4*k+0);
-          csg::set(p, center-dx, 4*k+1);
-          csg::set(p, center-dy, 4*k+2);
-          csg::set(p, center-dz, 4*k+3);
-          box.pmin = min(center, box.pmin);
-          box.pmax = max(center, box.pmax);
-        }
-        box.pmin -= 3.f * cellsize;
-        box.pmax += 3.f * cellsize;
-
-        loopk(4*subnum) {
-          const auto m0 = it[j+k/4].m0;
-          const auto m1 = it[j+k/4].m1;
-          bool const solidsolid = m0 != csg::MAT_AIR_INDEX && m1 != csg::MAT_AIR_INDEX;
-          nd[k] = solidsolid ? cellsize : 0.f;
-        }
-        CSGVER::dist(m_node, p, &nd, d, m, 4*subnum, box);
-        STATS_ADD(iso_num, 4*subnum);
-        STATS_ADD(iso_gradient_num, 4*subnum);
-
-        loopk(subnum) {
-          const auto c    = d[4*k+0];
-          const auto dfdx = d[4*k+1];
-          const auto dfdy = d[4*k+2];
-          const auto dfdz = d[4*k+3];
-          const auto grad = vec3f(c-dfdx, c-dfdy, c-dfdz);
-          const auto n = grad==vec3f(zero) ? vec3f(zero) : normalize(grad);
-          const auto p = it[j+k].p0;
-          m_edges.add({p,n,vec2i(it[j+k].m0,it[j+k].m1)});
-        }
+      edgepos(*stack, num);
+
+      // step 2 - compute normals for each point. the csg evaluators return
+      // the gradients analytically so one evaluation per point is enough
+      auto &p = stack->p;
+      auto &d = stack->d;
+      auto &m = stack->m;
+      auto &g = stack->g;
+      auto &nd = stack->nd;
+      auto box = aabb::empty();
+      loopj(num) {
+        const auto center = it[j].org + it[j].p0 * cellsize;
+        csg::set(p, center, j);
+        box.pmin = min(center, box.pmin);
+        box.pmax = max(center, box.pmax);
+        const auto m0 = it[j].m0, m1 = it[j].m1;
+        const bool solidsolid = m0 != csg::MAT_AIR_INDEX && m1 != csg::MAT_AIR_INDEX;
+        nd[j] = solidsolid ? cellsize : 0.f;
+      }
+      box.pmin -= 3.f * cellsize;
+      box.pmax += 3.f * cellsize;
+      csg::dist(m_program, m_regs, p, &nd, d, m, &g, num, box);
+      STATS_ADD(iso_num, num);
+      STATS_ADD(iso_gradient_num, num);
+
+      loopj(num) {
+        const auto grad = csg::get(g, j);
+        const auto n = grad==vec3f(zero) ? vec3f(zero) : normalize(grad);
+        const auto p = it[j].p0;
+        m_edges[m_todo_edges[i+j]] = {p,n,vec2i(it[j].m0,it[j].m1)};
       }
     }
   }
 
+  // vertices are solved by batches of soaf::size with the SIMD qef solver
+  struct pendingvertex {
+    vec3i xyz;
+    vec3f mass;
+    qef::qem q;
+    pair<int,int> mat;
+  };
+
+  void solvevertices(const pendingvertex *pending, float ata[6][soaf::size],
+                     float atb[3][soaf::size], int num)
+  {
+    // pad the unused lanes with a solvable system
+    rangei(num, int(soaf::size)) {
+      loopj(6) ata[j][i] = j==0||j==3||j==5 ? 1.f : 0.f;
+      loopj(3) atb[j][i] = 0.f;
+    }
+    soaf a[6];
+    loopi(6) a[i] = soaf::loadu(ata[i]);
+    const soa3f b(soaf::loadu(atb[0]), soaf::loadu(atb[1]), soaf::loadu(atb[2]));
+    const auto x = qef::evaluate(a, b);
+    float pos[3][soaf::size];
+    storeu(pos[0], x.x);
+    storeu(pos[1], x.y);
+    storeu(pos[2], x.z);
+    loopi(num) {
+      const auto &v = pending[i];
+      const auto p = v.mass + vec3f(pos[0][i], pos[1][i], pos[2][i]);
+      const auto worldpos = vertex(v.xyz) + p*cellsize;
+      const auto localpos = (vec3f(v.xyz)+p)*cellsize;
+
+      // insert the point in the leaf octree
+      pl.leaf.insert(v.xyz,pl.leaf.pts.length());
+      pl.leaf.pts.add({worldpos,localpos,v.q,v.xyz,v.mat});
+    }
+  }
+
   void finishvertices() {
+    const stagetimer timer(STAGE_FINISHVERTICES);
+    pendingvertex pending[soaf::size];
+    float ata[6][soaf::size], atb[3][soaf::size];
+    int num = 0;
     loopv(delayed_qef) {
       const auto &item = delayed_qef[i];
       const auto xyz = item.first;
@@ -523,9 +893,8 @@ struct gridbuilder {
       // get the intersection points between the surface and the cube edges
       qef::qem q;
       vec3f p[12], n[12], mass(zero);
-      vec3f nor = zero;
       pair<int,int> mat = airmat;
-      int num = 0, multimat = false;
+      int pnum = 0, multimat = false;
       const auto gridpos = vec3f(xyz) * cellsize;
       loopi(12) {
         if ((edgemap & (1<<i)) == 0) continue;
@@ -541,131 +910,205 @@ struct gridbuilder {
         else if (edgemat != mat)
           multimat = true;
 
-        p[num] = m_edges[idx].p+vec3f(e.first);
-        n[num] = m_edges[idx].n;
-        q += qef::qem(n[num], gridpos+cellsize*p[num]);
-        nor += n[num];
-        mass += p[num++];
+        p[pnum] = m_edges[idx].p+vec3f(e.first);
+        n[pnum] = m_edges[idx].n;
+        q += qef::qem(n[pnum], gridpos+cellsize*p[pnum]);
+        mass += p[pnum++];
       }
-      mass /= float(num);
-
-      // compute the QEF minimizing point
-      double matrix[12][3];
-      double vector[12];
-      loopi(num) {
-        loopj(3) matrix[i][j] = double(n[i][j]);
-        const auto d = p[i] - mass;
-        vector[i] = double(dot(n[i],d));
+      mass /= float(pnum);
+
+      // accumulate the normal equations of the QEF around the mass point
+      float m[6] = {0.f,0.f,0.f,0.f,0.f,0.f};
+      vec3f b(zero);
+      loopi(pnum) {
+        const auto nor = n[i];
+        const auto d = dot(nor, p[i]-mass);
+        m[0] += nor.x*nor.x; m[1] += nor.x*nor.y; m[2] += nor.x*nor.z;
+        m[3] += nor.y*nor.y; m[4] += nor.y*nor.z; m[5] += nor.z*nor.z;
+        b += nor*d;
       }
-      const auto pos = mass + qef::evaluate(matrix, vector, num);
-      const auto worldpos = vertex(xyz) + pos*cellsize;
-      const auto localpos = (vec3f(xyz)+pos)*cellsize;
+      loopi(6) ata[i][num] = m[i];
+      loopi(3) atb[i][num] = b[i];
+      pending[num++] = {xyz, mass, q, multimat?airmat:mat};
+      if (num == int(soaf::size)) {
+        solvevertices(pending, ata, atb, num);
+        num = 0;
+      }
+    }
+    if (num != 0) solvevertices(pending, ata, atb, num);
+  }
 
-      // insert the point in the leaf octree
-      pl.leaf.insert(xyz,pl.leaf.pts.length());
-      pl.leaf.pts.add({worldpos,localpos,q,xyz,multimat?airmat:mat});
+  // one bit per field sample, four samples at a time
+  void initsignbits() {
+    const auto limit = ssef(2.f*cellsize);
+    const auto items = &m_field[0];
+    loopi(FIELDWORDS) m_signbits[i] = m_farbits[i] = 0;
+    for (u32 i = 0; i < FIELDNUM; i += 4) {
+      const auto lo = ssef::loadu(&items[i].d), hi = ssef::loadu(&items[i+2].d);
+      const auto d = shuffle<0,2,0,2>(lo, hi);
+      const auto shift = i & 63;
+      m_signbits[i>>6] |= u64(movemask(d < ssef(zero))) << shift;
+      m_farbits[i>>6] |= u64(movemask(abs(d) > limit)) << shift;
     }
   }
 
+  // FIELDDIM bits of the row (y,z) starting at x = 0
+  INLINE u32 rowbits(const u64 *bits, u32 y, u32 z) const {
+    const auto offset = (y + z * FIELDDIM) * FIELDDIM;
+    const auto word = offset >> 6, shift = offset & 63;
+    auto row = bits[word] >> shift;
+    if (shift != 0) row |= bits[word+1] << (64-shift);
+    return u32(row) & ROWMASK;
+  }
+
+  // edges with a sign change are found row by row with the sign bits of the
+  // row and of its neighbors along y and z. we then only visit the crossings
   void tesselate() {
-    loopxyz(vec3i(zero), vec3i(FIELDDIM)) {
-      const auto startfield = field(xyz);
-      const auto startsign = startfield.d < 0.f ? 1 : 0;
-      if (abs(field(xyz).d) > 2.f*cellsize) continue;
-
-      // some quads belong to our neighbor. we will not push them but we need to
-      // compute their vertices such that our neighbor can output these quads
-      const auto outside = any(eq(xyz,0));
-
-      // look at the three edges that start on xyz
-      loopi(3) {
-
-        // is it an actual edge?
-        const auto end = xyz+axis[i];
-        if (any(ge(end,vec3i(FIELDDIM)))) continue;
-        const auto endfield = field(end);
-        const int endsign = endfield.d < 0.f ? 1 : 0;
-        if (startsign == endsign) continue;
-
-        // we found one edge. we output one quad for it
-        const auto axis0 = axis[(i+1)%3];
-        const auto axis1 = axis[(i+2)%3];
-        const vec3i p[] = {xyz, xyz-axis0, xyz-axis0-axis1, xyz-axis1};
-        loopj(4) {
-          const auto np = p[j];
-          if (any(lt(np,vec3i(zero))) || any(ge(np,vec3i(SUBGRID))))
-            continue;
-          const auto idx = qef_index(np);
-          if (m_qef_index[idx] == NOINDEX) {
-            mcell cell;
-            loopk(8) cell[k] = field(np+icubev[k]);
-            m_qef_index[idx] = m_qefnum++;
-            delayed_qef.add(makepair(np, delayed_qef_vertex(cell, np)));
-            STATS_INC(iso_qef_num);
+    const stagetimer timer(STAGE_TESSELATE);
+    initsignbits();
+    for (u32 z = 0; z < FIELDDIM; ++z)
+    for (u32 y = 0; y < FIELDDIM; ++y) {
+      const auto sign = rowbits(m_signbits, y, z);
+      const auto near = ~rowbits(m_farbits, y, z) & ROWMASK;
+      u32 crossing[3];
+      crossing[0] = (sign ^ (sign >> 1)) & near & (ROWMASK >> 1);
+      crossing[1] = y+1 < FIELDDIM ? (sign ^ rowbits(m_signbits, y+1, z)) & near : 0;
+      crossing[2] = z+1 < FIELDDIM ? (sign ^ rowbits(m_signbits, y, z+1)) & near : 0;
+      auto todo = crossing[0] | crossing[1] | crossing[2];
+      while (todo != 0) {
+        const vec3i xyz(__bscf(todo), y, z);
+        const auto &startfield = field(xyz);
+        const auto startsign = (sign >> xyz.x) & 1;
+
+        // some quads belong to our neighbor. we will not push them but we need
+        // to compute their vertices such that our neighbor can output these
+        // quads
+        const auto outside = any(eq(xyz,0));
+
+        // look at the three edges that start on xyz
+        loopi(3) {
+          if (((crossing[i] >> xyz.x) & 1) == 0) continue;
+
+          // we found one edge. we output one quad for it
+          const auto &endfield = field(xyz+axis[i]);
+          const auto axis0 = axis[(i+1)%3];
+          const auto axis1 = axis[(i+2)%3];
+          const vec3i p[] = {xyz, xyz-axis0, xyz-axis0-axis1, xyz-axis1};
+          loopj(4) {
+            const auto np = p[j];
+            if (any(lt(np,vec3i(zero))) || any(ge(np,vec3i(SUBGRID))))
+              continue;
+            const auto idx = qef_index(np);
+            if (m_qef_index[idx] == NOINDEX) {
+              mcell cell;
+              loopk(8) cell[k] = field(np+icubev[k]);
+              m_qef_index[idx] = m_qefnum++;
+              delayed_qef.add(makepair(np, delayed_qef_vertex(cell, np)));
+              STATS_INC(iso_qef_num);
+            }
           }
-        }
 
-        // we must use a more compact storage for it
-        if (outside) continue;
-        const auto qor = startsign==1 ? quadorder : quadorder_cc;
-        const quad q = {{p[qor[0]],p[qor[1]],p[qor[2]],p[qor[3]]},
-          max(startfield.m, endfield.m)
-        };
-        pl.leaf.quads.add(q);
+          // we must use a more compact storage for it
+          if (outside) continue;
+          const auto qor = startsign==1 ? quadorder : quadorder_cc;
+          const quad q = {{p[qor[0]],p[qor[1]],p[qor[2]],p[qor[3]]},
+            max(startfield.m, endfield.m)
+          };
+          pl.leaf.quads.add(q);
+        }
       }
     }
   }
 
-  void outputoctree(octree::node &node, int src = 0, int dst = 0) {
+  void outputoctree(int src = 0, int dst = 0) {
     const auto from = pl.leaf.getnode(src);
-    const auto to = node.leaf->getnode(dst);
+    const auto to = &m_outroot[dst];
     to->isleaf = from->isleaf;
     to->empty = from->empty;
 
     // if this is a leaf we stop here
     if (from->isleaf) {
       if (!from->empty) {
-        to->idx = node.leaf->pts.length();
-        node.leaf->pts.add({pl.leaf.pts[from->idx].world,-1});
+        to->idx = m_outpts.length();
+        m_outpts.add({pl.leaf.pts[from->idx].world,-1,~0u});
       }
       return;
     }
 
     // otherwise, we create all 8 children and recurse
-    const auto idx = node.leaf->root.length();
+    const auto idx = m_outroot.length();
     to->idx = idx;
-    node.leaf->root.setsize(idx+8);
-    loopi(8) outputoctree(node, from->idx+i, idx+i);
+    m_outroot.setsize(idx+8);
+    loopi(8) outputoctree(from->idx+i, idx+i);
   }
 
+  template <typename T> INLINE T *arenacopy(char *&dst, const vector<T> &v) {
+    if (v.length() == 0) return NULL;
+    const auto first = (T*) dst;
+    loopv(v) new (first+i) T(v[i]);
+    dst += ALIGN(v.length()*sizeof(T), sizeof(void*));
+    return first;
+  }
+
+  // the leaf is built in scratch vectors and copied with one allocation into
+  // the arena of its subtree
   void output(octree::node &node) {
-    node.leaf->root.setsize(1);
-    outputoctree(node);
-    node.leaf->root.refit();
-    node.leaf->pts.refit();
-    pl.leaf.quads.moveto(node.leaf->quads);
+    const stagetimer timer(STAGE_OUTPUT);
+    m_outroot.setsize(1);
+    m_outpts.setsize(0);
+    outputoctree();
+    const auto &quads = pl.leaf.quads;
+    const auto size =
+      ALIGN(sizeof(octree::leaftype), sizeof(void*)) +
+      ALIGN(m_outroot.length()*sizeof(leafoctreebase::node), sizeof(void*)) +
+      ALIGN(m_outpts.length()*sizeof(octree::qefpoint), sizeof(void*)) +
+      ALIGN(quads.length()*sizeof(quad), sizeof(void*));
+    auto dst = m_leafalloc.alloc(size);
+    const auto leaf = (octree::leaftype*) dst;
+    dst += ALIGN(sizeof(octree::leaftype), sizeof(void*));
+    leaf->root = arenacopy(dst, m_outroot);
+    leaf->pts = arenacopy(dst, m_outpts);
+    leaf->quads = arenacopy(dst, quads);
+    leaf->ptnum = m_outpts.length();
+    leaf->quadnum = quads.length();
+    node.leaf = leaf;
+    STATS_ADD(iso_arena_bytes, size);
   }
 
   void build(octree::node &node) {
     pl.leaf.init();
+    fetchfaces();
     initfield();
     initedge();
     initqef();
     tesselate();
     finishedges();
     finishvertices();
-    pl.merge();
+    {
+      const stagetimer timer(STAGE_MERGE);
+      pl.merge();
+    }
+    publishfaces();
     output(node);
   }
 
-  const csg::node *m_node;
+  const csg::program *m_program;
+  csg::registers m_regs;
   vector<fielditem> m_field;
+  u64 m_signbits[FIELDWORDS], m_farbits[FIELDWORDS];
   vector<u32> m_qef_index;
   vector<u32> m_edge_index;
   vector<edge> m_edges;
+  vector<u32> m_todo_edges;
+  vector<vec3i> m_blocks[2];
   vector<pair<vec3i,vec4i>> delayed_edges;
   vector<pair<vec3i,int>> delayed_qef;
+  vector<leafoctreebase::node> m_outroot;
+  vector<octree::qefpoint> m_outpts;
   edgestack *stack;
+  faceslot *m_faces[6];
+  faceslab *m_shared[6];
+  octree::leafallocator m_leafalloc;
   const octree *m_octree;
   procleaf pl;
   vec3f m_org;
@@ -679,21 +1122,234 @@ struct gridbuilder {
  - multi-threaded implementation of the iso surface extraction
  -------------------------------------------------------------------------*/
 static THREAD gridbuilder *localbuilder = NULL;
+struct stagetable;
 struct context {
   INLINE context() : m_mutex(SDL_CreateMutex()) {}
   SDL_mutex *m_mutex;
   vector<gridbuilder*> m_builders;
+  vector<stagetable*> m_stages;
 };
 static context *ctx = NULL;
 
+/*-------------------------------------------------------------------------
+ - per-stage timers. histograms have four buckets per power of two
+ - microseconds such that percentiles are known within 20%
+ -------------------------------------------------------------------------*/
+static const char *stagename[STAGE_NUM] = {
+  "initfield", "initedge", "initqef", "tesselate", "finishedges",
+  "finishvertices", "merge", "output", "chunk", "buildmesh", "decimate",
+  "sharpen", "vcache", "stitch"
+};
+static const u32 STAGE_BUCKET_NUM = 128;
+struct stagetable {
+  INLINE stagetable() { clear(); }
+  INLINE void clear() { memset(this, 0, sizeof(stagetable)); }
+  u64 total[STAGE_NUM];
+  u32 count[STAGE_NUM];
+  u32 histogram[STAGE_NUM][STAGE_BUCKET_NUM];
+};
+
+INLINE u32 stagebucket(u64 usec) {
+  if (usec < 8) return u32(usec);
+  const auto msb = u32(__bsr(size_t(usec)));
+  return min(4*(msb-1) + u32((usec >> (msb-2)) & 3), STAGE_BUCKET_NUM-1);
+}
+
+// middle of the bucket
+INLINE double stagebucketusec(u32 bucket) {
+  if (bucket < 8) return double(bucket);
+  const auto msb = bucket/4+1;
+  const auto width = u64(1) << (msb-2);
+  return double((4+(bucket&3))*width) + 0.5*double(width);
+}
+
+static THREAD stagetable *localstages = NULL;
+void recordstage(stage s, u64 usec) {
+  if (localstages == NULL) {
+    localstages = NEWE(stagetable);
+    SDL_LockMutex(ctx->m_mutex);
+      ctx->m_stages.add(localstages);
+    SDL_UnlockMutex(ctx->m_mutex);
+  }
+  localstages->total[s] += usec;
+  localstages->count[s]++;
+  localstages->histogram[s][stagebucket(usec)]++;
+}
+
+static s32 vcachetri = 0, vcachemissin = 0, vcachemissout = 0;
+void recordvcache(u32 trinum, u32 missin, u32 missout) {
+  atomic_add(&vcachetri, s32(trinum));
+  atomic_add(&vcachemissin, s32(missin));
+  atomic_add(&vcachemissout, s32(missout));
+}
+
+// timers are only read and cleared while no task runs the pipeline
+static void clearstages() {
+  loopv(ctx->m_stages) ctx->m_stages[i]->clear();
+  vcachetri = vcachemissin = vcachemissout = 0;
+}
+
+INLINE double acmr(s32 misses) {
+  return vcachetri == 0 ? 0.0 : double(misses)/double(vcachetri);
+}
+
+static void mergestages(stagetable &all) {
+  loopv(ctx->m_stages) {
+    const auto &t = *ctx->m_stages[i];
+    loopj(STAGE_NUM) {
+      all.total[j] += t.total[j];
+      all.count[j] += t.count[j];
+      loopk(STAGE_BUCKET_NUM) all.histogram[j][k] += t.histogram[j][k];
+    }
+  }
+}
+
+static double stagepercentile(const stagetable &t, u32 s, double p) {
+  const auto target = u32(ceil(p*double(t.count[s])));
+  u32 sum = 0;
+  loopi(STAGE_BUCKET_NUM) {
+    sum += t.histogram[s][i];
+    if (sum >= max(target,1u)) return stagebucketusec(i);
+  }
+  return 0.0;
+}
+
+static void printstages() {
+  stagetable all;
+  mergestages(all);
+  printf("%-16s %8s %12s %10s %10s\n", "stage", "count", "total ms", "p50 us", "p99 us");
+  loopi(STAGE_NUM) {
+    if (all.count[i] == 0) continue;
+    printf("%-16s %8u %12.3f %10.0f %10.0f\n", stagename[i], all.count[i],
+           double(all.total[i])*1e-3, stagepercentile(all, i, 0.5),
+           stagepercentile(all, i, 0.99));
+  }
+  if (vcachetri != 0)
+    printf("acmr %.3f -> %.3f\n", acmr(vcachemissin), acmr(vcachemissout));
+}
+
+bool dumpstages(const char *filename) {
+  const auto f = fopen(filename, "w");
+  if (f == NULL) return false;
+  stagetable all;
+  mergestages(all);
+  fprintf(f, "{\n");
+  loopi(STAGE_NUM) {
+    fprintf(f, "  \"%s\": {\"count\": %u, \"total_us\": %llu, "
+               "\"p50_us\": %.0f, \"p99_us\": %.0f},\n",
+            stagename[i], all.count[i], (unsigned long long) all.total[i],
+            stagepercentile(all, i, 0.5), stagepercentile(all, i, 0.99));
+  }
+  fprintf(f, "  \"acmr\": {\"in\": %.3f, \"out\": %.3f}\n",
+          acmr(vcachemissin), acmr(vcachemissout));
+  fprintf(f, "}\n");
+  fclose(f);
+  return true;
+}
+
+/*-------------------------------------------------------------------------
+ - octree slab allocation
+ -------------------------------------------------------------------------*/
+char *octree::allocator::alloc(u32 size) {
+  size = ALIGN(size, sizeof(void*));
+  if (head + size > tail) {
+    const auto sz = max(size, slabsize);
+    const auto s = (slab*) MALLOC(sizeof(slab) + sz);
+    SDL_LockMutex(ctx->m_mutex);
+      s->next = o->m_slabs;
+      o->m_slabs = s;
+    SDL_UnlockMutex(ctx->m_mutex);
+    head = s->data();
+    tail = head + sz;
+  }
+  head += size;
+  return head - size;
+}
+
+octree::node *octree::allocator::newchildren() {
+  const auto children = (node*) alloc(8*sizeof(node));
+  loopi(8) new (children+i) node();
+  return children;
+}
+
+char *octree::leafarena::newslab(u32 size) {
+  const auto s = (slab*) MALLOC(sizeof(slab) + size);
+  SDL_LockMutex(ctx->m_mutex);
+    s->next = slabs;
+    slabs = s;
+  SDL_UnlockMutex(ctx->m_mutex);
+#if !defined(RELEASE)
+  const auto total = (used += s32(size));
+  for (;;) {
+    const auto prev = iso_arena_max_bytes;
+    if (total <= prev || atomic_cmpxchg(&iso_arena_max_bytes, total, prev) == prev)
+      break;
+  }
+#else
+  used += s32(size);
+#endif /* defined(RELEASE) */
+  return s->data();
+}
+
+void octree::leafarena::destroy() {
+  while (slabs != NULL) {
+    const auto next = slabs->next;
+    FREE(slabs);
+    slabs = next;
+  }
+  used = 0;
+}
+
+// small enough to not waste much per thread and per subtree
+static const u32 LEAFSLAB = 64*1024;
+char *octree::leafallocator::alloc(u32 size) {
+  size = ALIGN(size, sizeof(void*));
+  if (head + size > tail) {
+    const auto sz = max(size, LEAFSLAB);
+    head = arena->newslab(sz);
+    tail = head + sz;
+  }
+  head += size;
+  return head - size;
+}
+
+octree::leafarena &octree::newarena(const node &subtree) {
+  const auto arena = NEW(leafarena, subtree);
+  SDL_LockMutex(ctx->m_mutex);
+    m_arenas.add(arena);
+  SDL_UnlockMutex(ctx->m_mutex);
+  return *arena;
+}
+
+static void clearleaves(octree::node &node) {
+  if (!node.isleaf)
+    loopi(8) clearleaves(node.children[i]);
+  else
+    node.leaf = NULL;
+}
+
+void octree::freeleaves(node &subtree) {
+  clearleaves(subtree);
+  SDL_LockMutex(ctx->m_mutex);
+    loopv(m_arenas) if (m_arenas[i]->root == &subtree) {
+      m_arenas[i]->destroy();
+      break;
+    }
+  SDL_UnlockMutex(ctx->m_mutex);
+}
+
 // run the contouring part per leaf of octree using small grids
 struct contouringtask : public task {
 
   // what to run per task iteration
   struct workitem {
-    const csg::node *csgnode;
+    faceslot slots[3];   // shared with the neighbors along +x, +y and +z
+    faceslot *faces[6];  // slots of the six faces (may be null)
+    csg::program *csgprogram;
+    u32 cost;            // estimated cost used to schedule the leaves
     struct octree::node *octnode;
     struct octree *oct;
+    octree::leafarena *arena; // leaf payloads of the subtree
     vec3i iorg;
     vec3f org;
     int level;
@@ -701,48 +1357,104 @@ struct contouringtask : public task {
     float cellsize;
   };
 
-  INLINE contouringtask(vector<workitem> &items) :
-    task("contouringtask", items.length()), items(items)
+  // chunks are ranges in the order vector which sorts the items from the most
+  // to the least expensive. the tasking system hands out the elements from
+  // the last to the first one so we reverse the indices to start with the
+  // most expensive chunks and finish with the cheap ones
+  INLINE contouringtask(vector<workitem> &items, vector<u32> &order,
+                        vector<u32> &chunks) :
+    task("contouringtask", chunks.length()-1),
+    items(items), order(order), chunks(chunks)
   {}
 
   virtual void run(u32 idx) {
+    const auto chunk = chunks.length()-2-idx;
+    rangei(chunks[chunk], chunks[chunk+1]) {
+#if !defined(RELEASE)
+      const auto start = sys::millis();
+#endif /* defined(RELEASE) */
+      runleaf(items[order[i]]);
+#if !defined(RELEASE)
+      const auto usec = s32(1000.f*(sys::millis()-start));
+      STATS_ADD(iso_leaf_usec, usec);
+      for (;;) {
+        const auto prev = iso_leaf_max_usec;
+        if (usec <= prev || atomic_cmpxchg(&iso_leaf_max_usec, usec, prev) == prev)
+          break;
+      }
+#endif /* defined(RELEASE) */
+    }
+  }
+
+  void runleaf(workitem &job) {
     if (localbuilder == NULL) {
       localbuilder = NEWE(gridbuilder);
       SDL_LockMutex(ctx->m_mutex);
       ctx->m_builders.add(localbuilder);
       SDL_UnlockMutex(ctx->m_mutex);
     }
-    const auto &job = items[idx];
     localbuilder->m_octree = job.oct;
+    localbuilder->m_leafalloc.setarena(job.arena);
     localbuilder->m_iorg = job.iorg;
     localbuilder->level = job.octnode->level;
     localbuilder->maxlvl = job.maxlvl;
     localbuilder->setcellsize(job.cellsize);
-    localbuilder->setnode(job.csgnode);
+    localbuilder->setprogram(job.csgprogram);
+    localbuilder->setfaces(job.faces);
     localbuilder->setorg(job.org);
     localbuilder->build(*job.octnode);
+    csg::destroyprogram(job.csgprogram);
+    job.csgprogram = NULL;
   }
   vector<workitem> &items;
+  vector<u32> &order, &chunks;
 };
 
-// build the octree topology needed to run contouring
+// build the octree topology needed to run contouring. the upper levels of the
+// octree are built by a hierarchy of tasks (one per node) such that subtrees
+// are built in parallel. each subtree then spawns the contouring of its own
+// leaves as soon as it is built
 struct isotask : public task {
   typedef contouringtask::workitem workitem;
-  INLINE isotask(octree &o, const csg::node &csgnode,
-                 const vec3f &org, float cellsize,
-                 u32 dim) :
+  INLINE isotask(octree &o, geom::meshbuilder &mb, const csg::node &csgnode,
+                 const vec3f &org, float cellsize, u32 dim,
+                 octree::node &node, const vec3i &xyz = vec3i(zero),
+                 u32 level = 0) :
     task("isotask", 1),
-    oct(&o), csgnode(&csgnode),
+    oct(&o), mb(&mb), csgnode(&csgnode),
+    alloc(o, level + SUBTREEDEPTH >= ilog2(dim/SUBGRID) ?
+             SUBTREESLAB : u32(8*sizeof(octree::node))),
     org(org), cellsize(cellsize),
-    dim(dim)
+    dim(dim), root(&node), xyz(xyz), level(level)
   {
     assert(ispoweroftwo(dim) && dim % SUBGRID == 0);
     maxlvl = ilog2(dim / SUBGRID);
   }
 
   virtual void run(u32) {
-    build(oct->m_root);
-    preparejobs(oct->m_root);
+    // upper level node. we classify it and spawn one task per child
+    if (level + SUBTREEDEPTH < maxlvl) {
+      if (!classify(*root, xyz, level)) return;
+      const auto cellnum = int(dim >> level);
+      loopi(8) {
+        const auto childxyz = xyz+cellnum*mortonoffset(i)/2;
+        ref<task> child = NEW(isotask, *oct, *mb, *csgnode, org, cellsize, dim,
+                              root->children[i], childxyz, level+1);
+        child->ends(*this);
+        child->scheduled();
+      }
+      return;
+    }
+
+    // root of a subtree. we build it, contour it and turn it into a mesh
+    // chunk
+    build(*root, xyz, level);
+    preparejobs(*root, xyz);
+    if (items.length() == 0) return;
+    const auto arena = &oct->newarena(*root);
+    loopv(items) items[i].arena = arena;
+    schedulejobs();
+    linkfaces();
     spawnnext();
   }
 
@@ -750,25 +1462,24 @@ struct isotask : public task {
     return org+cellsize*vec3f(xyz);
   }
 
-  void build(octree::node &node, const vec3i &xyz = vec3i(zero), u32 level = 0) {
+  // return true if the node has children to build
+  bool classify(octree::node &node, const vec3i &xyz, u32 level) {
     node.level = level;
     node.org = xyz;
 
-    // bounding box of this octree cell
-    const auto lod = maxlvl - level;
-    const vec3f pmin = pos(xyz - int(4<<lod));
-    const vec3f pmax = pos(xyz + int((SUBGRID+4)<<lod));
-
-    // center of the box where to evaluate the distance field
+    // bounding box of this octree cell with the two extra cells the grid
+    // builders need around it
     const auto cellnum = int(dim >> level);
-    const auto icenter = xyz + cellnum/2;
-    const auto center = pos(icenter);
-    const auto dist = csg::dist(csgnode, center, aabb(pmin,pmax));
+    const vec3f pmin = pos(xyz - 2);
+    const vec3f pmax = pos(xyz + cellnum + 2);
+
+    // the cell is empty if the surface cannot cross it
+    const auto dist = csg::dist(csgnode, aabb(pmin,pmax));
     STATS_INC(iso_octree_num);
     STATS_INC(iso_num);
-    if (abs(dist) > sqrt(3.f) * cellsize * float(cellnum/2+2)) {
+    if (dist.m > 0.f || dist.M < 0.f) {
       node.isleaf = node.empty = 1;
-      return;
+      return false;
     }
     if (cellnum == SUBGRID) {
 #if DEBUGOCTREE
@@ -776,74 +1487,198 @@ struct isotask : public task {
       const vec3f maxpos = pos(xyz+vec3i(SUBGRID)) + vec3f(debugsize);
       if (any(lt(debugpos,minpos)) || any(gt(debugpos,maxpos))) {
         node.empty = node.isleaf = 1;
-        return;
+        return false;
       }
 #endif /* DEBUGOCTREE */
-      node.leaf = NEWE(octree::leaftype);
+      // the payload is written by the thread that contours the leaf
       node.isleaf = 1;
-    } else {
-      node.children = NEWAE(octree::node, 8);
-      loopi(8) {
-        const auto childxyz = xyz+cellnum*icubev[i]/2;
-        build(node.children[i], childxyz, level+1);
-      }
+      return false;
     }
+    node.children = alloc.newchildren();
+    return true;
   }
 
-  void preparejobs(octree::node &node, const vec3i &xyz = vec3i(zero)) {
+  void build(octree::node &node, const vec3i &xyz, u32 level) {
+    if (!classify(node, xyz, level)) return;
+    const auto cellnum = int(dim >> level);
+    loopi(8) {
+      const auto childxyz = xyz+cellnum*mortonoffset(i)/2;
+      build(node.children[i], childxyz, level+1);
+    }
+  }
+
+  void preparejobs(octree::node &node, const vec3i &xyz) {
     if (node.isleaf && !node.empty) {
+      STATS_INC(iso_leaf_num);
       auto &job = items.add();
       job.oct = oct;
       job.octnode = &node;
-      job.csgnode = csgnode;
       job.iorg = xyz;
       job.maxlvl = maxlvl;
       job.level = node.level;
       job.cellsize = float(1<<(maxlvl-node.level)) * cellsize;
       job.org = pos(xyz);
+
+      // only keep the part of the csg tree the grid builder may query. it
+      // evaluates the field one cell around the leaf and looks a few cells
+      // further when it builds the edges
+      const auto lod = maxlvl - node.level;
+      const auto pmin = vec3f(xyz - int(4<<lod)) * job.cellsize;
+      const auto pmax = vec3f(xyz + int((FIELDDIM+6)<<lod)) * job.cellsize;
+      const auto sub = csg::specialize(csgnode, aabb(pmin, pmax));
+      job.csgprogram = csg::compile(sub.ptr);
+
+      // the cost mostly depends on how much the surface crosses the leaf and
+      // how expensive the csg program is. we estimate the first one with the
+      // number of leaf octants the surface may cross
+      const auto half = int(dim >> node.level) / 2;
+      int crossed = 0;
+      loopi(8) {
+        const auto octant = xyz + half*icubev[i];
+        const auto dist = csg::dist(sub.ptr, aabb(pos(octant-2), pos(octant+half+2)));
+        crossed += dist.m <= 0.f && dist.M >= 0.f ? 1 : 0;
+      }
+      STATS_ADD(iso_octree_num, 8);
+      STATS_ADD(iso_num, 8);
+      job.cost = max(crossed,1) * (csg::programlength(job.csgprogram)+1);
     } else if (!node.isleaf) loopi(8) {
       const auto cellnum = dim >> node.level;
-      const auto childxyz = xyz+int(cellnum/2)*icubev[i];
+      const auto childxyz = xyz+int(cellnum/2)*mortonoffset(i);
       preparejobs(node.children[i], childxyz);
     }
   }
 
+  // sort the leaves from the most to the least expensive and group the cheap
+  // ones in chunks. threads take the chunks dynamically such that the most
+  // expensive leaves run first and the cheap ones fill the end of the run
+  void schedulejobs() {
+    order.setsize(items.length());
+    loopv(order) order[i] = i;
+    quicksort(order.begin(), order.end(), [&](u32 a, u32 b) {
+      return items[a].cost > items[b].cost ||
+            (items[a].cost == items[b].cost && a < b);
+    });
+    u64 total = 0;
+    loopv(items) total += items[i].cost;
+    const auto target = max(total / CHUNK_NUM, u64(1));
+    chunks.setsize(0);
+    u64 cost = 0;
+    loopv(order) {
+      const auto itemcost = items[order[i]].cost;
+      if (i == 0 || cost + itemcost > target) {
+        chunks.add(i);
+        cost = 0;
+      }
+      cost += itemcost;
+    }
+    chunks.add(order.length());
+    STATS_ADD(iso_chunk_num, chunks.length()-1);
+  }
+
+  // neighbor leaves at the same level share the slot of their common face.
+  // other subtrees may be under construction so we only link leaves of our
+  // own subtree
+  void linkfaces() {
+    const auto subtreemin = xyz, subtreemax = xyz + int(dim >> level);
+    hash_map<const octree::node*, u32> leaves;
+    loopv(items) {
+      loopj(6) items[i].faces[j] = NULL;
+      leaves.insert(makepair((const octree::node*) items[i].octnode, u32(i)));
+    }
+    loopv(items) {
+      auto &job = items[i];
+      const auto cellnum = int(dim >> job.level);
+      loopj(3) {
+        const auto neighbor = job.iorg + cellnum*axis[j];
+        if (any(ge(neighbor, subtreemax)) || any(lt(neighbor, subtreemin)))
+          continue;
+        const auto node = oct->findneighbor(*job.octnode, 2*j+1);
+        if (node == NULL || !node->isleaf || node->empty ||
+            node->level != u32(job.level))
+          continue;
+        const auto it = leaves.find(node);
+        assert(it != leaves.end());
+        job.faces[2*j+1] = items[it->second].faces[2*j] = job.slots+j;
+      }
+    }
+  }
+
   void spawnnext() {
-    ref<task> contouring = NEW(contouringtask, items);
+    ref<task> contouring = NEW(contouringtask, items, order, chunks);
+    ref<task> mesh = geom::buildchunk(*mb, xyz, level);
+    contouring->starts(*mesh);
     contouring->ends(*this);
+    mesh->ends(*this);
+    mesh->scheduled();
     contouring->scheduled();
   }
 
   vector<workitem> items;
+  vector<u32> order, chunks;
   octree *oct;
+  geom::meshbuilder *mb;
   const csg::node *csgnode;
+  octree::allocator alloc;
   vec3f org;
   float cellsize;
   u32 dim, maxlvl;
+  octree::node *root;
+  vec3i xyz;
+  u32 level;
 };
 
-geom::mesh dc(const vec3f &org, u32 cellnum, float cellsize, const csg::node &csgnode) {
-  octree o(cellnum);
-  geom::mesh m;
-
-  ref<task> meshtask = geom::buildmesh(m, o, cellsize);
-  ref<task> contouringtask = NEW(isotask, o, csgnode, org, cellsize, cellnum);
-  contouringtask->starts(*meshtask);
-  meshtask->scheduled();
+static void dc(octree &o, geom::meshbuilder &mb, task &meshtask, const vec3f &org,
+               u32 cellnum, float cellsize, const csg::node &csgnode)
+{
+  clearstages();
+  ref<task> contouringtask = NEW(isotask, o, mb, csgnode, org, cellsize, cellnum, o.m_root);
+  contouringtask->starts(meshtask);
+  meshtask.scheduled();
   contouringtask->scheduled();
-  meshtask->wait();
+  meshtask.wait();
+  printstages();
+
+  // the arenas go away with the octree
+  loopv(ctx->m_builders) ctx->m_builders[i]->m_leafalloc = octree::leafallocator();
 
 #if !defined(RELEASE)
   stats();
 #endif /* defined(RELEASE) */
+}
 
+geom::mesh dc(const vec3f &org, u32 cellnum, float cellsize, const csg::node &csgnode) {
+  octree o(cellnum);
+  geom::mesh m;
+  const auto mb = geom::startmesh(o, cellsize);
+  ref<task> meshtask = geom::finishmesh(*mb, m);
+  dc(o, *mb, *meshtask, org, cellnum, cellsize, csgnode);
   return m;
 }
 
+void dc(const vec3f &org, u32 cellnum, float cellsize, const csg::node &csgnode,
+        geom::meshsink sink, void *udata, u32 lodnum)
+{
+  octree o(cellnum);
+  const auto mb = geom::startmesh(o, cellsize, sink, udata, lodnum);
+  ref<task> meshtask = geom::finishmesh(*mb);
+  dc(o, *mb, *meshtask, org, cellnum, cellsize, csgnode);
+}
+
+geom::meshkey dckey(const vec3f &org, u32 cellnum, float cellsize, const csg::node &csgnode) {
+  geom::meshkey key;
+  key.scene = csg::hashnode(&csgnode);
+  key.revision = DCREVISION;
+  key.cellnum = cellnum;
+  key.cellsize = cellsize;
+  key.org = org;
+  return key;
+}
+
 void start() { ctx = NEWE(context); }
 void finish() {
   if (ctx == NULL) return;
   loopv(ctx->m_builders) SAFE_DEL(ctx->m_builders[i]);
+  loopv(ctx->m_stages) SAFE_DEL(ctx->m_stages[i]);
   DEL(ctx);
 }
 } /* namespace iso */
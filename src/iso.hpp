@@ -12,6 +12,28 @@
 namespace q {
 namespace iso {
 
+/*-------------------------------------------------------------------------
+ - morton order used by both octrees. child i of a node is at offset
+ - (i&1, (i>>1)&1, (i>>2)&1) such that the three bits of each level of the
+ - morton code of a cell directly give the child to descend into
+ -------------------------------------------------------------------------*/
+INLINE u64 mortonspread(u32 x) {
+  u64 v = x & 0x1fffff;
+  v = (v | v << 32) & 0x1f00000000ffffull;
+  v = (v | v << 16) & 0x1f0000ff0000ffull;
+  v = (v | v << 8)  & 0x100f00f00f00f00full;
+  v = (v | v << 4)  & 0x10c30c30c30c30c3ull;
+  v = (v | v << 2)  & 0x1249249249249249ull;
+  return v;
+}
+INLINE u64 morton(const vec3i &xyz) {
+  return mortonspread(xyz.x) | mortonspread(xyz.y) << 1 | mortonspread(xyz.z) << 2;
+}
+INLINE u32 mortonchild(u64 code, u32 logsize) { return u32(code >> (3*logsize)) & 7; }
+INLINE vec3i mortonoffset(u32 child) {
+  return vec3i(child&1, (child>>1)&1, (child>>2)&1);
+}
+
 /*-------------------------------------------------------------------------
  - quad as generated by iso contouring
  -------------------------------------------------------------------------*/
@@ -34,10 +56,10 @@ struct leafoctreebase {
     u32 empty:1;
   };
   INLINE node *getnode(int idx) { return &root[idx]; }
-  INLINE u32 descend(vec3i &xyz, u32 level, u32 idx);
+  INLINE int getidx(vec3i xyz) { return getidx(&root[0], xyz); }
+  static int getidx(const node *root, vec3i xyz);
   void init();
   void insert(vec3i xyz, int ptidx);
-  int getidx(vec3i xyz);
   vector<node> root; // root node of the leaf octree
 };
 
@@ -62,32 +84,147 @@ struct leafoctree : leafoctreebase {
 struct octree {
   struct qefpoint {
     vec3f pos;
-    int idx;
+    int idx;   // vertex index in the mesh chunk that uses it
+    u32 chunk; // mesh chunk that owns the vertex
+  };
+  // leaf output. it is written once in the leaf arena of its subtree
+  struct leaftype {
+    INLINE qefpoint *get(vec3i xyz) {
+      const auto idx = leafoctreebase::getidx(root, xyz);
+      return idx == -1 ? NULL : pts+idx;
+    }
+    leafoctreebase::node *root;
+    qefpoint *pts;
+    quad *quads;
+    u32 ptnum, quadnum;
   };
   struct node {
     INLINE node() : children(NULL), level(0), isleaf(0), empty(0) {}
-    ~node();
     union {
-      node *children;
-      leafoctree<qefpoint> *leaf;
+      node *children; // 8 children in morton order
+      leaftype *leaf;
     };
     vec3i org;
     u32 level:30;
     u32 isleaf:1;
     u32 empty:1;
   };
-  typedef leafoctree<qefpoint> leaftype;
 
-  INLINE octree(u32 dim) : m_dim(dim), m_logdim(ilog2(dim)) {}
+  // nodes are carved out of big slabs owned by the octree and released all
+  // at once with it. every task building a part of the octree has its own
+  // allocator such that only taking a new slab is serialized. children are
+  // allocated while the octree is built depth first so the nodes of a
+  // subtree end up contiguous and in morton order
+  struct slab;
+  struct allocator {
+    INLINE allocator(octree &o, u32 slabsize) :
+      o(&o), head(NULL), tail(NULL), slabsize(slabsize) {}
+    node *newchildren();
+    char *alloc(u32 size);
+    octree *o;
+    char *head, *tail;
+    u32 slabsize;
+  };
+
+  // leaf payloads of one subtree live in their own slabs. the slabs go away
+  // with the subtree leaves or with the octree
+  struct leafarena {
+    INLINE leafarena(const node &root) : root(&root), slabs(NULL), used(0) {}
+    ~leafarena() { destroy(); }
+    char *newslab(u32 size);
+    void destroy();
+    const node *root;
+    slab *slabs;
+    atomic used;
+  };
+
+  // every thread contouring leaves bumps its own range of a leaf arena. only
+  // taking a new slab from the arena is serialized
+  struct leafallocator {
+    INLINE leafallocator() : arena(NULL), head(NULL), tail(NULL) {}
+    INLINE void setarena(leafarena *a) {
+      if (a != arena) *this = leafallocator();
+      arena = a;
+    }
+    char *alloc(u32 size);
+    leafarena *arena;
+    char *head, *tail;
+  };
+
+  octree(u32 dim);
+  ~octree();
+  leafarena &newarena(const node &subtree);
+  void freeleaves(node &subtree); // release the leaf payloads of a subtree
   const node *findleaf(vec3i xyz) const;
+  const node *findnode(vec3i xyz, u32 level) const;
+  INLINE node *findnode(vec3i xyz, u32 level) {
+    return const_cast<node*>(static_cast<const octree*>(this)->findnode(xyz, level));
+  }
+  // same lookups from the morton code of a cell inside the grid
+  const node *findleaf(u64 code) const;
+  const node *findnode(u64 code, u32 level) const;
+  // node sharing the given face with n: 2*axis for -axis, 2*axis+1 for +axis.
+  // this is the node at the level of n or the coarser leaf covering it. NULL
+  // when the face is on the grid boundary
+  const node *findneighbor(const node &n, u32 face) const;
   node m_root;
+  slab *m_slabs;
+  vector<leafarena*> m_arenas;
   u32 m_dim, m_logdim;
 };
 static const u32 SUBGRID = 16;
 
+/*-------------------------------------------------------------------------
+ - scoped timers on the stages of the pipeline. every thread aggregates its
+ - own timings in histograms. they are cheap enough to always run such that
+ - release builds can tell which stage got slower
+ -------------------------------------------------------------------------*/
+enum stage {
+  STAGE_INITFIELD,
+  STAGE_INITEDGE,
+  STAGE_INITQEF,
+  STAGE_TESSELATE,
+  STAGE_FINISHEDGES,
+  STAGE_FINISHVERTICES,
+  STAGE_MERGE,
+  STAGE_OUTPUT,
+  STAGE_CHUNK,
+  STAGE_BUILDMESH,
+  STAGE_DECIMATE,
+  STAGE_SHARPEN,
+  STAGE_VCACHE,
+  STAGE_STITCH,
+  STAGE_NUM
+};
+void recordstage(stage s, u64 usec);
+struct stagetimer {
+  INLINE stagetimer(stage s) : s(s), start(sys::microseconds()) {}
+  INLINE ~stagetimer() { recordstage(s, sys::microseconds()-start); }
+  stage s;
+  u64 start;
+};
+
+// post-transform cache misses of the mesh chunks before and after their
+// reordering. the average cache miss ratios are reported with the timings
+void recordvcache(u32 trinum, u32 missin, u32 missout);
+
+// dc prints its timings as a table when done. they can also be written as
+// json. return false if it failed
+bool dumpstages(const char *filename);
+
 // tesselate along a grid the distance field with dual contouring algorithm
 geom::mesh dc(const vec3f &org, u32 cellnum, float cellsize, const csg::node &d);
 
+// same but the mesh is given chunk by chunk to the sink. every chunk is emitted
+// with lodnum levels of details
+void dc(const vec3f &org, u32 cellnum, float cellsize, const csg::node &d,
+        geom::meshsink sink, void *udata = NULL, u32 lodnum = 1);
+
+// key of the mesh dc builds from these parameters. it is used to cache meshes
+// on disk so bump DCREVISION when dc output changes for the same input
+static const u32 DCREVISION = 1;
+geom::meshkey dckey(const vec3f &org, u32 cellnum, float cellsize, const csg::node &d);
+
 void start();
 void finish();
 } /* namespace iso */
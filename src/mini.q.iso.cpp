@@ -24,9 +24,43 @@ static void outputcpufeatures() {
   con::out(features.c_str());
 }
 
+// chunked output. every chunk of every level of details and the seams go to
+// their own file such that the whole mesh never lives in memory
+struct chunkwriter {
+  INLINE chunkwriter(const geom::meshkey &key) : key(key), num(0), trinum(0) {}
+  geom::meshkey key;
+  u32 num, trinum;
+};
+
+static void writechunk(const geom::mesh &m, u32 lod, void *udata) {
+  auto &w = *(chunkwriter*) udata;
+  const auto name = lod == geom::SEAMLOD ?
+    fixedstring(fmt, "simple-seam.mesh") :
+    fixedstring(fmt, "simple-lod%u-%04u.mesh", lod, w.num);
+  if (!geom::store(name.c_str(), m, geom::MESH_COMPACT, w.key))
+    con::out("iso: unable to write %s", name.c_str());
+  if (lod == 0 || lod == geom::SEAMLOD) w.trinum += m.m_indexnum/3;
+  ++w.num;
+}
+
 static const float CELLSIZE = 0.1f;
+static const u32 CELLNUM = 4096;
+
+// usage: mini.q.iso [-l<lodnum>] [script] [stages.json]. with -l, the mesh is
+// streamed to disk chunk by chunk with lodnum levels of details
 int main(int argc, const char **argv) {
   outputcpufeatures();
+  const char *script = "data/csg.lua", *stages = NULL;
+  u32 lodnum = 0, argnum = 0;
+  rangei(1, argc) {
+    if (argv[i][0] == '-') switch (argv[i][1]) {
+      case 'l': lodnum = max(atoi(&argv[i][2]), 1); break;
+      default: con::out("unknown commandline option");
+    } else if (argnum++ == 0)
+      script = argv[i];
+    else
+      stages = argv[i];
+  }
 
   con::out("init: memory debugger");
   sys::memstart();
@@ -45,16 +79,31 @@ int main(int argc, const char **argv) {
   con::out("init: csg module");
   csg::start();
   // load the csg function
-  script::execscript(argv[1] ? argv[1] : "data/csg.lua");
+  script::execscript(script);
   const auto node = csg::makescene();
 
   // build the mesh
   assert(node != NULL);
+  const auto org = vec3f(0.15f);
+  const auto key = iso::dckey(org, CELLNUM, CELLSIZE, *node);
   const auto start = sys::millis();
-  const auto m = iso::dc(vec3f(0.15f), 4096, CELLSIZE, *node);
+  chunkwriter w(key);
+  geom::mesh m;
+  if (lodnum != 0)
+    iso::dc(org, CELLNUM, CELLSIZE, *node, writechunk, &w, lodnum);
+  else
+    m = iso::dc(org, CELLNUM, CELLSIZE, *node);
   const auto end = sys::millis();
   printf("time %f ms\n", float(end-start));
-  geom::store("simple.mesh", m);
+  if (stages != NULL && !iso::dumpstages(stages))
+    con::out("iso: unable to write stage timings to %s", stages);
+  if (lodnum != 0)
+    con::out("iso: %u files written, %u triangles at lod 0 with the seams",
+             w.num, w.trinum);
+  else {
+    geom::store("simple.mesh", m, geom::MESH_COMPACT, key);
+    m.destroy();
+  }
 #if !defined(NDEBUG)
   finish();
 #endif
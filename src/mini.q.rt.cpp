@@ -7,7 +7,6 @@
 #include "rt.hpp"
 #include "iso.hpp"
 #include "csg.hpp"
-#include <zlib.h>
 
 namespace q {
 static void playerpos(int x, int y, int z) {game::player1->o = vec3f(vec3i(x,y,z));}
@@ -18,23 +17,10 @@ static void loadworld(const char *name) {
   geom::mesh m;
   con::out("init: loading %s", name);
   const auto start = sys::millis();
-  auto f = gzopen(name, "rb");
-  if (f==NULL) {
-    con::out("failed to open %s", name);
+  if (!geom::load(name, m)) {
+    con::out("failed to load %s", name);
     exit(EXIT_FAILURE);
   }
-  gzread(f, &m.m_indexnum, sizeof(m.m_indexnum));
-  gzread(f, &m.m_vertnum, sizeof(m.m_vertnum));
-  gzread(f, &m.m_segmentnum, sizeof(m.m_segmentnum));
-  m.m_index = (u32*) MALLOC(sizeof(u32)*m.m_indexnum);
-  m.m_pos = (vec3f*) MALLOC(sizeof(vec3f)*m.m_vertnum);
-  m.m_nor = (vec3f*) MALLOC(sizeof(vec3f)*m.m_vertnum);
-  m.m_segment = (geom::segment*) MALLOC(sizeof(geom::segment)*m.m_segmentnum);
-  gzread(f, m.m_index, sizeof(u32) * m.m_indexnum);
-  gzread(f, m.m_pos, sizeof(vec3f) * m.m_vertnum);
-  gzread(f, m.m_nor, sizeof(vec3f) * m.m_vertnum);
-  gzread(f, m.m_segment, sizeof(geom::segment) * m.m_segmentnum);
-  gzclose(f);
   con::out("init: %s loaded in %.2f ms", name, float(sys::millis()-start));
   rt::buildbvh(m.m_pos, m.m_index, m.m_indexnum);
 }
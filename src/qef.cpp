@@ -11,6 +11,9 @@ namespace qef {
 static const u32 MAXROWS = 12;
 static const double EPSILON = 1e-5;
 
+// singular values below this are truncated
+static const double MIN_SINGULAR_VALUE = 0.1;
+
 static double factorize_hh(double *ptrs[], int n) {
   double tau = 0.0;
 
@@ -716,14 +719,76 @@ vec3f evaluate(double mat[][3], double *vec, int rows) {
 
   // solve linear system given by mat and vec using the
   // singular value decomposition of mat into u, v and d.
-  if (d[2] < 0.1) d[2] = 0.0;
-  if (d[1] < 0.1) d[1] = 0.0;
-  if (d[0] < 0.1) d[0] = 0.0;
+  if (d[2] < MIN_SINGULAR_VALUE) d[2] = 0.0;
+  if (d[1] < MIN_SINGULAR_VALUE) d[1] = 0.0;
+  if (d[0] < MIN_SINGULAR_VALUE) d[0] = 0.0;
 
   double x[3];
   solveSVD(u, v, d, vec, x, rows);
   return vec3f(float(x[0]), float(x[1]), float(x[2]));
 }
+
+/*-------------------------------------------------------------------------
+ - batched solver. the eigen values of A^T.A are the squared singular values
+ - of A. we diagonalize it with cyclic jacobi rotations which are branch free
+ - and therefore run on all lanes at once
+ -------------------------------------------------------------------------*/
+static const u32 JACOBI_SWEEPS = 4;
+
+// annihilate a[p][q] and accumulate the rotation in v
+static INLINE void jacobi(soaf a[3][3], soaf v[3][3], int p, int q) {
+  const auto apq = a[p][q];
+  const auto theta = (a[q][q]-a[p][p]) / (2.f*apq);
+  const auto t = (soaf(one) / (abs(theta)+sqrt(theta*theta+soaf(one)))) ^ signmsk(theta);
+  const auto c0 = soaf(one) / sqrt(t*t+soaf(one));
+  const auto rotate = abs(apq) > soaf(1e-12f);
+  const auto c = select(rotate, c0, soaf(one));
+  const auto s = select(rotate, t*c0, soaf(zero));
+  loopk(3) {
+    const auto akp = a[k][p], akq = a[k][q];
+    a[k][p] = c*akp - s*akq;
+    a[k][q] = s*akp + c*akq;
+  }
+  loopk(3) {
+    const auto apk = a[p][k], aqk = a[q][k];
+    a[p][k] = c*apk - s*aqk;
+    a[q][k] = s*apk + c*aqk;
+  }
+  loopk(3) {
+    const auto vkp = v[k][p], vkq = v[k][q];
+    v[k][p] = c*vkp - s*vkq;
+    v[k][q] = s*vkp + c*vkq;
+  }
+}
+
+soa3f evaluate(const soaf ata[6], const soa3f &atb) {
+  soaf a[3][3] = {
+    {ata[0], ata[1], ata[2]},
+    {ata[1], ata[3], ata[4]},
+    {ata[2], ata[4], ata[5]}
+  };
+  soaf v[3][3] = {
+    {soaf(one), soaf(zero), soaf(zero)},
+    {soaf(zero), soaf(one), soaf(zero)},
+    {soaf(zero), soaf(zero), soaf(one)}
+  };
+  loopi(JACOBI_SWEEPS) {
+    jacobi(a, v, 0, 1);
+    jacobi(a, v, 0, 2);
+    jacobi(a, v, 1, 2);
+  }
+
+  // x = V.D^+.V^T.A^T.b with the same truncation as the SVD solver
+  const auto minvalue = soaf(float(MIN_SINGULAR_VALUE*MIN_SINGULAR_VALUE));
+  soaf w[3];
+  loopi(3) {
+    const auto vtb = v[0][i]*atb.x + v[1][i]*atb.y + v[2][i]*atb.z;
+    w[i] = select(a[i][i] >= minvalue, vtb / a[i][i], soaf(zero));
+  }
+  return soa3f(v[0][0]*w[0] + v[0][1]*w[1] + v[0][2]*w[2],
+               v[1][0]*w[0] + v[1][1]*w[1] + v[1][2]*w[2],
+               v[2][0]*w[0] + v[2][1]*w[1] + v[2][2]*w[2]);
+}
 } /* namespace qef */
 } /* namespace q */
 
@@ -6,6 +6,7 @@
 #pragma once
 #include "base/math.hpp"
 #include "base/pair.hpp"
+#include "soa.hpp"
 
 namespace q {
 namespace qef {
@@ -15,15 +16,23 @@ namespace qef {
 // that describe at least two planes, the QEF evalulates to the point x.
 vec3f evaluate(double mat[][3], double *vec, int rows);
 
+// same but solves soaf::size QEFs at once from their normal equations. ata
+// stores the symmetric A^T.A as (xx,xy,xz,yy,yz,zz) and atb stores A^T.b. the
+// result is the truncated pseudo-inverse solution (minimum norm) within 5e-5
+// cell. the SVD solver above only agrees on well conditioned systems. on flat
+// or edge cells, it may return another minimizer up to one cell away. vertices
+// on flat areas therefore move on purpose compared to the SVD solver
+soa3f evaluate(const soaf ata[6], const soa3f &atb);
+
 /*-------------------------------------------------------------------------
  - quadratic error matrix (as proposed by Garland et al.)
  -------------------------------------------------------------------------*/
 struct qem {
-  INLINE qem() {ZERO(this); next=-1;}
-  INLINE qem(vec3f v0, vec3f v1, vec3f v2) : timestamp(0), next(-1) {
+  INLINE qem() {ZERO(this);}
+  INLINE qem(vec3f v0, vec3f v1, vec3f v2) : timestamp(0) {
     init(cross(v0-v1,v0-v2), v0);
   }
-  INLINE qem(vec3f d, vec3f p) : timestamp(0), next(-1) { init(d,p); }
+  INLINE qem(vec3f d, vec3f p) : timestamp(0) { init(d,p); }
   INLINE void init(const vec3f &d, const vec3f &p) {
     const auto len = double(length(d));
     if (len != 0.) {
@@ -69,7 +78,7 @@ struct qem {
   double ab, ac, ad;
   double bc, bd;
   double cd;
-  int timestamp, next;
+  int timestamp;
 };
 
 INLINE qem operator+ (const qem &q0, const qem &q1) {
@@ -597,20 +597,30 @@ void finish() {
 }
 #endif
 
-VAR(isofromfile, 0, 0, 1);
+VAR(isocache, 0, 1, 1);
 static const float CELLSIZE = 0.1f;
+static const u32 CELLNUM = 4096;
 static void makescene() {
   if (initialized_m) return;
 
-  // create the indexed mesh from the scene description
+  // create the indexed mesh from the scene description. meshes are cached on
+  // disk under the hash of the scene. the file keeps the whole key so a
+  // collision or other dc parameters only miss the cache
   geom::mesh m;
-  if (!isofromfile || !geom::load("simple.mesh", m)) {
-    const auto start = sys::millis();
-    const auto node = csg::makescene();
-    assert(node != NULL);
-    m = iso::dc(vec3f(0.15f), 4096, CELLSIZE, *node);
+  const auto node = csg::makescene();
+  assert(node != NULL);
+  const auto org = vec3f(0.15f);
+  const auto key = iso::dckey(org, CELLNUM, CELLSIZE, *node);
+  const fixedstring cachename(fmt, "scene-%016llx.mesh", (unsigned long long) key.scene);
+  const auto start = sys::millis();
+  if (isocache && geom::load(cachename.c_str(), m, &key))
+    con::out("csg: %s loaded in %f ms", cachename.c_str(), float(sys::millis()-start));
+  else {
+    m = iso::dc(org, CELLNUM, CELLSIZE, *node);
     const auto duration = sys::millis() - start;
     con::out("csg: elapsed %f ms ", float(duration));
+    if (isocache && !geom::store(cachename.c_str(), m, geom::MESH_RAW, key))
+      con::out("csg: unable to write %s", cachename.c_str());
   }
   ogl::genbuffers(1, &sceneposbo);
   ogl::bindbuffer(ogl::ARRAY_BUFFER, sceneposbo);